@@ -1,6 +1,261 @@
-void Init_JPEG();
-void Init_PNG();
-void Init_Interpolation();
+#include "axon.h"
+
+#ifdef HAVE_RUBY_THREAD_H
+#include <ruby/thread.h>
+#endif
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#define AXON_PTHREAD 1
+#endif
+
+#if defined(HAVE_RB_THREAD_CALL_WITHOUT_GVL) && \
+    defined(HAVE_RB_THREAD_CALL_WITH_GVL)
+#define AXON_NOGVL 1
+#endif
+
+struct protect_call {
+    VALUE (*fn)(VALUE);
+    VALUE arg;
+    int state;
+};
+
+/*
+ * Runs +fn+ without the GVL, if this ruby lets us, so that other threads can
+ * run while we are busy inside libjpeg or libpng. +fn+ must not touch any Ruby
+ * objects except through axon_protect().
+ */
+
+void
+axon_nogvl(void *(*fn)(void *), void *arg)
+{
+#ifdef AXON_NOGVL
+    rb_thread_call_without_gvl(fn, arg, NULL, NULL);
+#else
+    fn(arg);
+#endif
+}
+
+struct parallel {
+    void (*fn)(void *arg, size_t job);
+    void *arg;
+    size_t jobs, next, threads;
+#ifdef AXON_PTHREAD
+    pthread_mutex_t lock;
+#endif
+};
+
+static void *
+parallel_worker(void *arg)
+{
+    struct parallel *p = (struct parallel *)arg;
+    size_t job;
+
+    for (;;) {
+#ifdef AXON_PTHREAD
+	pthread_mutex_lock(&p->lock);
+	job = p->next++;
+	pthread_mutex_unlock(&p->lock);
+#else
+	job = p->next++;
+#endif
+	if (job >= p->jobs)
+	    return NULL;
+
+	p->fn(p->arg, job);
+    }
+}
+
+static void *
+parallel_run(void *arg)
+{
+#ifdef AXON_PTHREAD
+    struct parallel *p = (struct parallel *)arg;
+    pthread_t *tids;
+    size_t i, started = 0;
+
+    tids = malloc((p->threads - 1) * sizeof(*tids));
+    if (tids)
+	for (i = 0; i < p->threads - 1; i++, started++)
+	    if (pthread_create(&tids[i], NULL, parallel_worker, p))
+		break;
+
+    /* If we couldn't start every thread we just do more of the work here. */
+    parallel_worker(p);
+
+    for (i = 0; i < started; i++)
+	pthread_join(tids[i], NULL);
+
+    free(tids);
+    return NULL;
+#else
+    return parallel_worker(arg);
+#endif
+}
+
+/*
+ * Calls +fn+ once for every job number in 0...+jobs+, spread across up to
+ * +threads+ native threads, and returns once they are all done. Like
+ * axon_nogvl(), +fn+ runs without the GVL and must not touch Ruby objects.
+ */
+
+void
+axon_parallel(void (*fn)(void *arg, size_t job), void *arg, size_t jobs,
+	      size_t threads)
+{
+    struct parallel p;
+
+    p.fn = fn;
+    p.arg = arg;
+    p.jobs = jobs;
+    p.next = 0;
+    p.threads = threads < jobs ? threads : jobs;
+    if (p.threads < 1)
+	p.threads = 1;
+
+#ifdef AXON_PTHREAD
+    pthread_mutex_init(&p.lock, NULL);
+    axon_nogvl(parallel_run, &p);
+    pthread_mutex_destroy(&p.lock);
+#else
+    axon_nogvl(parallel_run, &p);
+#endif
+}
+
+static void *
+protect_call(void *arg)
+{
+    struct protect_call *call = (struct protect_call *)arg;
+
+    rb_protect(call->fn, call->arg, &call->state);
+    return NULL;
+}
+
+/*
+ * Calls +fn+ from inside a libjpeg or libpng callback. If +nogvl+ is set we
+ * are running under axon_nogvl() and have to take the GVL back first.
+ *
+ * Exceptions must never unwind through the image libraries, so they are
+ * caught here and their tag returned. The caller is expected to longjmp back
+ * to its own error handler and re-raise with rb_jump_tag().
+ */
+
+int
+axon_protect(int nogvl, VALUE (*fn)(VALUE), VALUE arg)
+{
+    struct protect_call call;
+
+    call.fn = fn;
+    call.arg = arg;
+    call.state = 0;
+
+#ifdef AXON_NOGVL
+    if (nogvl) {
+	rb_thread_call_with_gvl(protect_call, &call);
+	return call.state;
+    }
+#endif
+
+    protect_call(&call);
+    return call.state;
+}
+
+/*
+ * Returns a string of +len+ bytes for a scanline to be written into. When the
+ * caller passed in a +buffer+ it is resized and reused, otherwise a new string
+ * is allocated.
+ */
+
+VALUE
+axon_buffer(VALUE buffer, size_t len)
+{
+    if (NIL_P(buffer))
+	return rb_str_new(0, len);
+
+    StringValue(buffer);
+    rb_str_modify(buffer);
+    if ((size_t)RSTRING_LEN(buffer) != len)
+	rb_str_resize(buffer, len);
+
+    return buffer;
+}
+
+/*
+ * Grows +str+, an output String that is being filled in place, to hold at
+ * least +len+ bytes. It at least doubles so that it is resized only a few
+ * times. Needs the GVL.
+ */
+
+void
+axon_str_reserve(VALUE str, size_t len)
+{
+    size_t size = RSTRING_LEN(str);
+
+    if (len <= size)
+	return;
+
+    size *= 2;
+    if (size < len)
+	size = len;
+
+    rb_str_resize(str, size);
+}
+
+/*
+ * Returns room for +n+ more rows after the ones queued in +rows+, or NULL if
+ * we run out of memory. The caller adds the rows it fills to rows->count.
+ *
+ * This doesn't touch any Ruby objects, so decoders may call it without the
+ * GVL.
+ */
+
+unsigned char *
+axon_rows_reserve(struct axon_rows *rows, size_t n)
+{
+    unsigned char *buf;
+    size_t alloc;
+
+    if (rows->start + rows->count + n <= rows->alloc)
+	return rows->buf + (rows->start + rows->count) * rows->row_len;
+
+    if (rows->start) {
+	memmove(rows->buf, rows->buf + rows->start * rows->row_len,
+		rows->count * rows->row_len);
+	rows->start = 0;
+    }
+
+    if (rows->count + n > rows->alloc) {
+	alloc = rows->alloc * 2;
+	if (alloc < rows->count + n)
+	    alloc = rows->count + n;
+
+	buf = realloc(rows->buf, alloc * rows->row_len);
+	if (!buf)
+	    return NULL;
+
+	rows->buf = buf;
+	rows->alloc = alloc;
+    }
+
+    return rows->buf + rows->count * rows->row_len;
+}
+
+/*
+ * Moves up to +n+ queued rows into +dest+ and returns how many there were.
+ */
+
+size_t
+axon_rows_shift(struct axon_rows *rows, unsigned char *dest, size_t n)
+{
+    if (n > rows->count)
+	n = rows->count;
+
+    memcpy(dest, rows->buf + rows->start * rows->row_len, n * rows->row_len);
+    rows->start += n;
+    rows->count -= n;
+
+    return n;
+}
 
 void
 Init_axon()
@@ -8,4 +263,6 @@ Init_axon()
     Init_JPEG();
     Init_PNG();
     Init_Interpolation();
+    Init_Pipeline();
+    Init_MappedFile();
 }
@@ -0,0 +1,158 @@
+#ifndef AXON_H
+#define AXON_H
+
+#include <ruby.h>
+#include <setjmp.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * A native scanline source.
+ *
+ * When an image chain is made entirely of Axon classes, the writers pull rows
+ * through read_row() instead of calling #gets on every stage. Each call fills
+ * +row+ with exactly width * components bytes. Stages we don't know about are
+ * wrapped in a source that falls back to calling #gets.
+ *
+ * Sources that can produce many rows at once more cheaply, such as the
+ * decoders, also set read_strip() to fill +strip+ with +n+ packed rows.
+ *
+ * Native stages don't call into Ruby while reading, so when the head of the
+ * pipeline is one the pipeline reads strips without the GVL. It reads ahead
+ * from the other sources, a strip at a time, with the GVL held.
+ */
+
+struct axon_source {
+    void (*read_row)(struct axon_source *src, unsigned char *row);
+    void (*read_strip)(struct axon_source *src, unsigned char *strip, size_t n);
+    void (*free)(struct axon_source *src);
+    struct axon_source *upstream;
+    struct axon_pipeline *pipeline;
+    VALUE obj;
+    VALUE buffer;
+    void *data;
+    int native;
+
+    size_t width, height, components, lineno;
+
+    /* stage parameters & scratch rows, owned by the source */
+    size_t x_offset, y_offset;
+    unsigned char *buf1, *buf2;
+
+    /* rows read ahead from a decoder */
+    unsigned char *ahead;
+    size_t ahead_rows, ahead_pos;
+};
+
+/* The most scanlines the readers and writers move in a single strip. */
+#define AXON_STRIP_ROWS 64
+
+struct axon_pipeline {
+    struct axon_source *head;
+    unsigned char *strip;
+    size_t row_len, strip_height;
+
+    /* strips are read without the GVL, errors longjmp back to jmp */
+    int nogvl, tag;
+    const char *error;
+    jmp_buf jmp;
+};
+
+void axon_pipeline_init(struct axon_pipeline *pipeline);
+void axon_pipeline_build(struct axon_pipeline *pipeline, VALUE image,
+			 size_t row_len, size_t strip_height);
+unsigned char *axon_pipeline_read_strip(struct axon_pipeline *pipeline,
+					size_t n);
+void axon_pipeline_free(struct axon_pipeline *pipeline);
+
+/* Format readers hook themselves into a pipeline. */
+int axon_jpeg_source(struct axon_source *src, VALUE obj);
+int axon_png_source(struct axon_source *src, VALUE obj);
+
+/* Files and strings read natively by the decoders, see Axon::MappedFile */
+struct axon_file {
+    int fd;
+    unsigned char *map;		/* the whole file or string, if we have it */
+    unsigned char *buf;		/* otherwise a read buffer */
+    size_t size, pos;		/* of the mapping or the buffer */
+};
+
+struct axon_file *axon_file_get(VALUE obj);
+void axon_file_string(struct axon_file *file, VALUE str);
+ssize_t axon_file_read(struct axon_file *file, const unsigned char **data,
+		       size_t max);
+
+/* Writes straight to the descriptor of a File, see axon_fd_open() */
+#define AXON_FD_BUFSIZE (64 * 1024)
+
+struct axon_fd {
+    int fd;			/* -1 when the io is written with io.write */
+    size_t hint;		/* bytes to preallocate before the first write */
+    off_t pos, end;		/* file offset, end of the preallocated space */
+};
+
+int axon_fd_open(struct axon_fd *out, VALUE io, size_t hint);
+int axon_fd_write(struct axon_fd *out, const unsigned char *data, size_t len);
+int axon_fd_write_nogvl(struct axon_fd *out, const unsigned char *data,
+			size_t len);
+void axon_fd_close(struct axon_fd *out);
+
+/* Interpolation kernels */
+struct axon_bilinear {
+    size_t width, src_width, components;
+    uint32_t *offsets;		/* c00 & c10 byte offsets per output pixel */
+    int16_t *weights;		/* and their fixed point weights */
+};
+
+void axon_bilinear_init(struct axon_bilinear *b, size_t width,
+			size_t src_width, size_t components);
+void axon_bilinear_free(struct axon_bilinear *b);
+void axon_bilinear_columns(struct axon_bilinear *b, int16_t *dest,
+			   unsigned char *src);
+void axon_bilinear_rows(struct axon_bilinear *b, unsigned char *dest,
+			int16_t *row1, int16_t *row2, double ty);
+struct axon_area {
+    size_t width, src_width, components;
+    uint32_t *bins;		/* accumulator offset for each source column */
+    uint32_t *counts;		/* source columns in each output column */
+};
+
+void axon_area_init(struct axon_area *a, size_t width, size_t src_width,
+		    size_t components);
+void axon_area_free(struct axon_area *a);
+void axon_area_add(struct axon_area *a, uint64_t *acc, unsigned char *src);
+void axon_area_emit(struct axon_area *a, unsigned char *dest, uint64_t *acc,
+		    size_t rows);
+size_t axon_area_first_row(size_t row, size_t height, size_t src_height);
+
+void axon_strip_alpha(unsigned char *dest, unsigned char *src, size_t width,
+		      size_t components, unsigned char *background);
+
+void axon_nearest_row(unsigned char *dest, size_t width, size_t src_width,
+		      size_t components, unsigned char *scanline);
+
+VALUE axon_buffer(VALUE buffer, size_t len);
+void axon_str_reserve(VALUE str, size_t len);
+
+/* Decoded scanlines waiting to be read from a reader fed with << */
+struct axon_rows {
+    unsigned char *buf;
+    size_t row_len;
+    size_t start, count, alloc;	/* in rows */
+};
+
+unsigned char *axon_rows_reserve(struct axon_rows *rows, size_t n);
+size_t axon_rows_shift(struct axon_rows *rows, unsigned char *dest, size_t n);
+
+void axon_nogvl(void *(*fn)(void *), void *arg);
+void axon_parallel(void (*fn)(void *arg, size_t job), void *arg, size_t jobs,
+		   size_t threads);
+int axon_protect(int nogvl, VALUE (*fn)(VALUE), VALUE arg);
+
+void Init_JPEG();
+void Init_PNG();
+void Init_Interpolation();
+void Init_Pipeline();
+void Init_MappedFile();
+
+#endif
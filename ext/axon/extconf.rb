@@ -28,4 +28,56 @@ unless have_library('png')
   abort "libpng was not found."
 end
 
+# PNG.write deflates row bands itself when asked to use several threads.
+unless have_header('zlib.h') && have_library('z', 'deflate')
+  abort "zlib was not found."
+end
+
+# Lets JPEG::Reader decode just the region a Cropper asks for.
+if have_func('jpeg_crop_scanline', ['stdio.h', 'jpeglib.h'])
+  have_func('jpeg_skip_scanlines', ['stdio.h', 'jpeglib.h'])
+end
+
+# Lets Axon::MappedFile hand whole files to the decoders.
+if have_header('sys/mman.h') && have_func('mmap', 'sys/mman.h')
+  have_func('madvise', 'sys/mman.h')
+end
+
+# Lets writers to a File set aside room for the image up front.
+have_func('posix_fallocate', 'fcntl.h')
+
+# Lets writers find the descriptor behind a File.
+have_func('rb_io_descriptor', 'ruby/io.h')
+have_func('rb_io_mode', 'ruby/io.h')
+
+# Lets the encoders spread work across threads.
+if have_header('pthread.h')
+  have_library('pthread', 'pthread_create')
+end
+
+# Lets us decode and encode without holding the GVL.
+if have_header('ruby/thread.h')
+  have_func('rb_thread_call_without_gvl', 'ruby/thread.h')
+  have_func('rb_thread_call_with_gvl', 'ruby/thread.h')
+end
+
+# Some kernels pick SSSE3 or AVX2 paths at runtime when the compiler can build
+# them.
+avx2_src = <<-SRC
+#include <immintrin.h>
+__attribute__((target("avx2"))) static void add(short *a) {
+    __m256i v = _mm256_loadu_si256((__m256i *)a);
+    _mm256_storeu_si256((__m256i *)a, _mm256_add_epi16(v, v));
+}
+int main() {
+    short a[16] = {0};
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) add(a);
+    return a[0];
+}
+SRC
+
+checking_for('CPU dispatch') { try_link(avx2_src) } and
+  $defs.push('-DHAVE_CPU_DISPATCH')
+
 create_makefile('axon/axon')
@@ -0,0 +1,433 @@
+#include "axon.h"
+#include <ruby/io.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef HAVE_MMAP
+#include <sys/mman.h>
+#endif
+
+#ifndef O_CLOEXEC
+#define O_CLOEXEC 0
+#endif
+
+/* Newer rubies hide the fields of rb_io_t behind accessors. */
+#if defined(HAVE_RB_IO_DESCRIPTOR) && defined(HAVE_RB_IO_MODE)
+#define AXON_IO_API 1
+#endif
+
+/* How much we read at once when a file can't be mapped. */
+#define FILE_BUFSIZE (256 * 1024)
+
+static VALUE cMappedFile;
+
+static void
+close_fd(struct axon_file *file)
+{
+    if (file->fd >= 0) {
+	close(file->fd);
+	file->fd = -1;
+    }
+}
+
+static void
+deallocate(struct axon_file *file)
+{
+    close_fd(file);
+
+#ifdef HAVE_MMAP
+    if (file->map)
+	munmap(file->map, file->size);
+#endif
+
+    free(file->buf);
+    free(file);
+}
+
+static VALUE
+allocate(VALUE klass)
+{
+    struct axon_file *file;
+    VALUE self;
+
+    self = Data_Make_Struct(klass, struct axon_file, 0, deallocate, file);
+    file->fd = -1;
+
+    return self;
+}
+
+#ifdef HAVE_MMAP
+static void
+map_file(struct axon_file *file)
+{
+    struct stat st;
+    void *map;
+
+    if (fstat(file->fd, &st) || !S_ISREG(st.st_mode) || st.st_size <= 0 ||
+	(unsigned long long)st.st_size > (size_t)-1)
+	return;
+
+    map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, file->fd, 0);
+    if (map == MAP_FAILED)
+	return;
+
+#ifdef HAVE_MADVISE
+    madvise(map, (size_t)st.st_size, MADV_SEQUENTIAL);
+#endif
+
+    file->map = (unsigned char *)map;
+    file->size = (size_t)st.st_size;
+    close_fd(file);
+}
+#endif
+
+/*
+ *  call-seq:
+ *     MappedFile.new(path) -> file
+ *
+ *  Opens the file at +path+ for reading by JPEG::Reader and PNG::Reader.
+ *
+ *  Regular files are memory mapped and the readers decode straight out of the
+ *  mapping. Anything else is read in large blocks. Either way no Ruby method
+ *  is called and no Ruby string is allocated while the image is read.
+ *
+ *  A MappedFile should only be read by one reader.
+ *
+ *     file = Axon::MappedFile.new("image.jpg")
+ *     reader = Axon::JPEG::Reader.new(file)
+ */
+
+static VALUE
+initialize(VALUE self, VALUE path)
+{
+    struct axon_file *file;
+
+    Data_Get_Struct(self, struct axon_file, file);
+    FilePathValue(path);
+
+    if (file->fd >= 0 || file->map || file->buf)
+	rb_raise(rb_eRuntimeError, "MappedFile is already open.");
+
+    file->fd = open(RSTRING_PTR(path), O_RDONLY | O_CLOEXEC);
+    if (file->fd < 0)
+	rb_sys_fail(RSTRING_PTR(path));
+
+#ifdef HAVE_MMAP
+    map_file(file);
+#endif
+
+    if (!file->map) {
+	file->buf = malloc(FILE_BUFSIZE);
+	if (!file->buf) {
+	    close_fd(file);
+	    rb_raise(rb_eNoMemError, "unable to allocate a read buffer");
+	}
+    }
+
+    return self;
+}
+
+/*
+ * Points +data+ at the next bytes of +file+, up to +max+ of them, and returns
+ * how many there are. Returns 0 at the end of the file and -1 with errno set on
+ * a read error.
+ *
+ * This never touches a Ruby object, so the decoders can call it without the
+ * GVL.
+ */
+
+ssize_t
+axon_file_read(struct axon_file *file, const unsigned char **data, size_t max)
+{
+    size_t avail;
+    ssize_t n;
+
+    if (!file->buf) {
+	avail = file->size - file->pos;
+	*data = file->map + file->pos;
+    } else {
+	if (file->pos == file->size) {
+	    if (file->fd < 0) {
+		errno = EBADF;
+		return -1;
+	    }
+
+	    do {
+		n = read(file->fd, file->buf, FILE_BUFSIZE);
+	    } while (n < 0 && errno == EINTR);
+
+	    if (n < 0)
+		return -1;
+
+	    file->pos = 0;
+	    file->size = (size_t)n;
+	}
+
+	avail = file->size - file->pos;
+	*data = file->buf + file->pos;
+    }
+
+    if (avail > max)
+	avail = max;
+
+    file->pos += avail;
+    return (ssize_t)avail;
+}
+
+/*
+ * Sets up +file+ to read the bytes of +str+ in place. The caller must keep
+ * +str+ alive and unchanged while +file+ is read, e.g. by holding on to a
+ * frozen copy of it.
+ */
+
+void
+axon_file_string(struct axon_file *file, VALUE str)
+{
+    file->fd = -1;
+    file->map = (unsigned char *)RSTRING_PTR(str);
+    file->buf = NULL;
+    file->size = (size_t)RSTRING_LEN(str);
+    file->pos = 0;
+}
+
+/*
+ * Returns the file behind +obj+ if it is a MappedFile, or NULL otherwise.
+ */
+
+struct axon_file *
+axon_file_get(VALUE obj)
+{
+    struct axon_file *file;
+
+    if (!rb_obj_is_kind_of(obj, cMappedFile))
+	return NULL;
+
+    Data_Get_Struct(obj, struct axon_file, file);
+    return file;
+}
+
+/*
+ * Sets up +out+ to write to the descriptor behind +io+ when it is a File
+ * opened write-only in binary mode, after flushing anything Ruby has buffered.
+ * Anything else, including subclasses of File that may override #write, is
+ * left to io.write and gets a descriptor of -1. Returns whether the
+ * descriptor can be used.
+ *
+ * +hint+ is the expected size of the output. If it isn't 0 and we are
+ * writing at the end of a regular file, that much space is set aside with
+ * posix_fallocate before the first write.
+ */
+
+int
+axon_fd_open(struct axon_fd *out, VALUE io, size_t hint)
+{
+    int mode, fd;
+#ifndef AXON_IO_API
+    rb_io_t *fptr;
+#endif
+
+    out->fd = -1;
+    out->hint = 0;
+    out->pos = out->end = 0;
+
+    if (rb_obj_class(io) != rb_cFile)
+	return 0;
+
+#ifdef AXON_IO_API
+    fd = rb_io_descriptor(io);
+    mode = rb_io_mode(io);
+#else
+    GetOpenFile(io, fptr);
+    fd = fptr->fd;
+    mode = fptr->mode;
+#endif
+
+    mode &= FMODE_READABLE | FMODE_WRITABLE | FMODE_BINMODE;
+    if (mode != (FMODE_WRITABLE | FMODE_BINMODE))
+	return 0;
+
+    rb_io_flush(io);
+    out->fd = fd;
+    out->hint = hint;
+
+    return 1;
+}
+
+static void
+fd_reserve(struct axon_fd *out)
+{
+#ifdef HAVE_POSIX_FALLOCATE
+    struct stat st;
+    off_t pos;
+
+    if (fstat(out->fd, &st) || !S_ISREG(st.st_mode))
+	return;
+
+    /* Don't make room in the middle of a file. */
+    pos = lseek(out->fd, 0, SEEK_CUR);
+    if (pos != st.st_size)
+	return;
+
+    if (posix_fallocate(out->fd, pos, (off_t)out->hint) == 0) {
+	out->pos = pos;
+	out->end = pos + (off_t)out->hint;
+    }
+#endif
+}
+
+/*
+ * Writes all +len+ bytes of +data+ to +out+. Returns 0 on success and -1
+ * with errno set on a write error.
+ *
+ * This never touches a Ruby object, so the encoders can call it without the
+ * GVL.
+ */
+
+int
+axon_fd_write(struct axon_fd *out, const unsigned char *data, size_t len)
+{
+    ssize_t n;
+
+    if (out->hint) {
+	fd_reserve(out);
+	out->hint = 0;
+    }
+
+    while (len) {
+	n = write(out->fd, data, len);
+	if (n < 0) {
+	    if (errno == EINTR)
+		continue;
+	    return -1;
+	}
+
+	data += n;
+	len -= (size_t)n;
+	out->pos += n;
+    }
+
+    return 0;
+}
+
+struct fd_write {
+    struct axon_fd *out;
+    const unsigned char *data;
+    size_t len;
+    int ret, err;
+};
+
+static void *
+fd_write_nogvl(void *arg)
+{
+    struct fd_write *w = (struct fd_write *)arg;
+
+    w->ret = axon_fd_write(w->out, w->data, w->len);
+    w->err = errno;
+    return NULL;
+}
+
+/* Like axon_fd_write(), for callers holding the GVL. */
+
+int
+axon_fd_write_nogvl(struct axon_fd *out, const unsigned char *data,
+		    size_t len)
+{
+    struct fd_write w;
+
+    w.out = out;
+    w.data = data;
+    w.len = len;
+    axon_nogvl(fd_write_nogvl, &w);
+
+    errno = w.err;
+    return w.ret;
+}
+
+/*
+ * Gives back whatever preallocated space the output didn't use.
+ */
+
+void
+axon_fd_close(struct axon_fd *out)
+{
+    if (out->fd >= 0 && out->end > out->pos) {
+	if (ftruncate(out->fd, out->pos) == 0)
+	    out->end = out->pos;
+    }
+}
+
+/*
+ *  call-seq:
+ *     file.read([length]) -> string or nil
+ *
+ *  Reads up to +length+ bytes, or the rest of the file when +length+ is not
+ *  given. Returns nil at the end of the file.
+ */
+
+static VALUE
+f_read(int argc, VALUE *argv, VALUE self)
+{
+    struct axon_file *file;
+    const unsigned char *data;
+    VALUE length, str;
+    size_t max;
+    ssize_t n;
+
+    rb_scan_args(argc, argv, "01", &length);
+    Data_Get_Struct(self, struct axon_file, file);
+
+    max = NIL_P(length) ? (size_t)-1 : NUM2SIZET(length);
+    str = rb_str_new(0, 0);
+
+    while (max) {
+	n = axon_file_read(file, &data, max);
+	if (n < 0)
+	    rb_sys_fail("read");
+	if (n == 0)
+	    break;
+
+	rb_str_cat(str, (const char *)data, n);
+	max -= (size_t)n;
+    }
+
+    if (RSTRING_LEN(str) == 0 && !NIL_P(length) && NUM2SIZET(length) > 0)
+	return Qnil;
+
+    return str;
+}
+
+/*
+ *  call-seq:
+ *     file.close -> nil
+ *
+ *  Closes the underlying file descriptor. A mapping is released when the
+ *  MappedFile is garbage collected, since a reader may still be decoding out
+ *  of it.
+ */
+
+static VALUE
+f_close(VALUE self)
+{
+    struct axon_file *file;
+
+    Data_Get_Struct(self, struct axon_file, file);
+    close_fd(file);
+
+    return Qnil;
+}
+
+void
+Init_MappedFile()
+{
+    VALUE mAxon;
+
+    mAxon = rb_define_module("Axon");
+    cMappedFile = rb_define_class_under(mAxon, "MappedFile", rb_cObject);
+    rb_define_alloc_func(cMappedFile, allocate);
+    rb_define_method(cMappedFile, "initialize", initialize, 1);
+    rb_define_method(cMappedFile, "read", f_read, -1);
+    rb_define_method(cMappedFile, "close", f_close, 0);
+}
@@ -1,4 +1,16 @@
-#include <ruby.h>
+#include "axon.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#ifdef HAVE_CPU_DISPATCH
+#include <immintrin.h>
+#endif
+
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
 
 /*     c00                 a    c10
  *      --------------------------
@@ -25,56 +37,699 @@
  *          ty       * (1 - tx) * c01 +
  *          ty       * tx       * c11
  */
-static VALUE
-bilinear2(size_t width, size_t src_width, size_t components, double ty,
-	  char *scanline1, char *scanline2)
+/*
+ * The weights above are applied in two passes, using 16-bit fixed point so
+ * that the inner loops map directly onto SIMD multiply-add instructions.
+ *
+ * axon_bilinear_columns() runs once per source scanline and interpolates
+ * horizontally between c00 and c10 with Q14 weights, keeping 7 fractional bits
+ * of the result. axon_bilinear_rows() then blends two of those scanlines with
+ * Q14 weights for ty and rounds back down to 8 bits.
+ *
+ * The per-column source offsets and weights only depend on the image widths,
+ * so they are computed once and kept in a struct axon_bilinear.
+ */
+
+#define WEIGHT_BITS 14
+#define WEIGHT_ONE (1 << WEIGHT_BITS)
+#define COLUMN_BITS 7
+#define ROW_SHIFT (WEIGHT_BITS + COLUMN_BITS)
+
+static void (*columns1_kernel)(struct axon_bilinear *, int16_t *,
+			       unsigned char *);
+static void (*columns3_kernel)(struct axon_bilinear *, int16_t *,
+			       unsigned char *);
+static void (*columns4_kernel)(struct axon_bilinear *, int16_t *,
+			       unsigned char *);
+static void (*rows_kernel)(unsigned char *, int16_t *, int16_t *, size_t,
+			   int32_t);
+static void (*drop4_kernel)(unsigned char *, unsigned char *, size_t);
+static const char *kernel_name;
+
+void
+axon_bilinear_init(struct axon_bilinear *b, size_t width, size_t src_width,
+		   size_t components)
 {
-    VALUE rb_dest_sl;
-    double width_ratio_inv, sample_x, tx, _tx, p00, p10, p01, p11;
-    unsigned char *c00, *c10, *c01, *c11, *dest_sl;
-    size_t sample_x_i, i, j;
+    double width_ratio_inv, sample_x, tx;
+    size_t sample_x_i, next, i;
+    int16_t w;
+
+    b->width = width;
+    b->src_width = src_width;
+    b->components = components;
+    b->offsets = ALLOC_N(uint32_t, width * 2);
+    b->weights = ALLOC_N(int16_t, width * 2);
 
-    rb_dest_sl = rb_str_new(0, width * components);
-    dest_sl = RSTRING_PTR(rb_dest_sl);
-    
     width_ratio_inv = (double)src_width / width;
 
     for (i = 0; i < width; i++) {
 	sample_x = i * width_ratio_inv;
 	sample_x_i = (int)sample_x;
-
 	tx = sample_x - sample_x_i;
-	_tx = 1 - tx;
 
-	p11 =  tx * ty;
-	p01 = _tx * ty;
-	p10 =  tx - p11;
-	p00 = _tx - p01;
+	/* c10 past the right edge is the edge pixel again */
+	next = sample_x_i + 1 < src_width ? sample_x_i + 1 : src_width - 1;
+
+	w = (int16_t)(tx * WEIGHT_ONE + 0.5);
+	b->offsets[i * 2] = sample_x_i * components;
+	b->offsets[i * 2 + 1] = next * components;
+	b->weights[i * 2] = WEIGHT_ONE - w;
+	b->weights[i * 2 + 1] = w;
+    }
+}
 
-	c00 = scanline1 + sample_x_i * components;
-	c10 = c00 + components;
-	c01 = scanline2 + sample_x_i * components;
-	c11 = c01 + components;
+void
+axon_bilinear_free(struct axon_bilinear *b)
+{
+    xfree(b->offsets);
+    xfree(b->weights);
+    b->offsets = NULL;
+    b->weights = NULL;
+}
+
+/*
+ * Scalar kernels. These define the results the SIMD kernels must match, and
+ * finish off the pixels the SIMD kernels leave over, starting at pixel +i+.
+ */
+
+static inline void
+columns_n(struct axon_bilinear *b, int16_t *dest, unsigned char *src,
+	  size_t components, size_t i)
+{
+    unsigned char *c00, *c10;
+    int32_t w0, w1;
+    size_t j;
+
+    dest += i * components;
+
+    for (; i < b->width; i++) {
+	c00 = src + b->offsets[i * 2];
+	c10 = src + b->offsets[i * 2 + 1];
+	w0 = b->weights[i * 2];
+	w1 = b->weights[i * 2 + 1];
 
 	for (j = 0; j < components; j++)
-	    *dest_sl++ = p00 * c00[j] + p10 * c10[j] + p01 * c01[j] +
-			 p11 * c11[j];
+	    *dest++ = (c00[j] * w0 + c10[j] * w1 +
+		       (1 << (COLUMN_BITS - 1))) >> COLUMN_BITS;
+    }
+}
+
+static void
+columns1(struct axon_bilinear *b, int16_t *dest, unsigned char *src)
+{
+    columns_n(b, dest, src, 1, 0);
+}
+
+static void
+columns3(struct axon_bilinear *b, int16_t *dest, unsigned char *src)
+{
+    columns_n(b, dest, src, 3, 0);
+}
+
+static void
+columns4(struct axon_bilinear *b, int16_t *dest, unsigned char *src)
+{
+    columns_n(b, dest, src, 4, 0);
+}
+
+/*
+ * The SIMD kernels for 3 components load 4 bytes from c00 and c10 and store 4
+ * values, the last of which the next pixel overwrites. Returns how many pixels
+ * from the left they can do without running past the end of a row.
+ */
+
+static size_t
+columns3_safe(struct axon_bilinear *b)
+{
+    size_t i, end = b->src_width * 3;
+
+    for (i = 0; i + 1 < b->width; i++)
+	if (b->offsets[i * 2 + 1] + 4 > end)
+	    break;
+
+    return i;
+}
+
+static void
+rows_scalar(unsigned char *dest, int16_t *row1, int16_t *row2, size_t len,
+	    int32_t weights)
+{
+    int32_t w0, w1;
+    size_t i;
+
+    w0 = (int16_t)(weights & 0xFFFF);
+    w1 = weights >> 16;
+
+    for (i = 0; i < len; i++)
+	dest[i] = (row1[i] * w0 + row2[i] * w1 + (1 << (ROW_SHIFT - 1))) >>
+		  ROW_SHIFT;
+}
+
+#ifdef __SSE2__
+
+/* The 4 values from c00 and c10 of pixel +i+, interpolated to 32 bits. */
+
+static inline __m128i
+column4_sse2(struct axon_bilinear *b, unsigned char *src, size_t i)
+{
+    __m128i px, sum;
+    int32_t c00, c10, weights;
+
+    memcpy(&c00, src + b->offsets[i * 2], 4);
+    memcpy(&c10, src + b->offsets[i * 2 + 1], 4);
+    memcpy(&weights, b->weights + i * 2, 4);
+
+    /* c00[0] c10[0] c00[1] c10[1] ... widened to 16 bits */
+    px = _mm_unpacklo_epi8(_mm_cvtsi32_si128(c00), _mm_cvtsi32_si128(c10));
+    px = _mm_unpacklo_epi8(px, _mm_setzero_si128());
+
+    sum = _mm_madd_epi16(px, _mm_set1_epi32(weights));
+    sum = _mm_add_epi32(sum, _mm_set1_epi32(1 << (COLUMN_BITS - 1)));
+    return _mm_srai_epi32(sum, COLUMN_BITS);
+}
+
+static void
+columns1_sse2(struct axon_bilinear *b, int16_t *dest, unsigned char *src)
+{
+    __m128i round, lo, hi;
+    uint32_t *o;
+    size_t i;
+
+    round = _mm_set1_epi32(1 << (COLUMN_BITS - 1));
+
+    for (i = 0; i + 8 <= b->width; i += 8) {
+	/* c00 and c10 of each pixel next to each other, like the weights */
+	o = b->offsets + i * 2;
+	lo = _mm_setr_epi16(src[o[0]], src[o[1]], src[o[2]], src[o[3]],
+			    src[o[4]], src[o[5]], src[o[6]], src[o[7]]);
+	hi = _mm_setr_epi16(src[o[8]], src[o[9]], src[o[10]], src[o[11]],
+			    src[o[12]], src[o[13]], src[o[14]], src[o[15]]);
+
+	lo = _mm_madd_epi16(lo, _mm_loadu_si128((__m128i *)(b->weights +
+							     i * 2)));
+	hi = _mm_madd_epi16(hi, _mm_loadu_si128((__m128i *)(b->weights +
+							     i * 2 + 8)));
+	lo = _mm_srai_epi32(_mm_add_epi32(lo, round), COLUMN_BITS);
+	hi = _mm_srai_epi32(_mm_add_epi32(hi, round), COLUMN_BITS);
+	_mm_storeu_si128((__m128i *)(dest + i), _mm_packs_epi32(lo, hi));
+    }
+
+    columns_n(b, dest, src, 1, i);
+}
+
+static void
+columns3_sse2(struct axon_bilinear *b, int16_t *dest, unsigned char *src)
+{
+    __m128i sum;
+    size_t i, n;
+
+    n = columns3_safe(b);
+
+    for (i = 0; i < n; i++) {
+	sum = column4_sse2(b, src, i);
+	_mm_storel_epi64((__m128i *)(dest + i * 3), _mm_packs_epi32(sum, sum));
+    }
+
+    columns_n(b, dest, src, 3, i);
+}
+
+static void
+columns4_sse2(struct axon_bilinear *b, int16_t *dest, unsigned char *src)
+{
+    __m128i sum;
+    size_t i;
+
+    for (i = 0; i < b->width; i++) {
+	sum = column4_sse2(b, src, i);
+	_mm_storel_epi64((__m128i *)(dest + i * 4), _mm_packs_epi32(sum, sum));
+    }
+}
+
+static void
+rows_sse2(unsigned char *dest, int16_t *row1, int16_t *row2, size_t len,
+	  int32_t weights)
+{
+    __m128i w, round, r1, r2, lo, hi;
+    size_t i;
+
+    w = _mm_set1_epi32(weights);
+    round = _mm_set1_epi32(1 << (ROW_SHIFT - 1));
+
+    for (i = 0; i + 8 <= len; i += 8) {
+	r1 = _mm_loadu_si128((__m128i *)(row1 + i));
+	r2 = _mm_loadu_si128((__m128i *)(row2 + i));
+
+	lo = _mm_madd_epi16(_mm_unpacklo_epi16(r1, r2), w);
+	hi = _mm_madd_epi16(_mm_unpackhi_epi16(r1, r2), w);
+	lo = _mm_srai_epi32(_mm_add_epi32(lo, round), ROW_SHIFT);
+	hi = _mm_srai_epi32(_mm_add_epi32(hi, round), ROW_SHIFT);
+
+	lo = _mm_packs_epi32(lo, hi);
+	_mm_storel_epi64((__m128i *)(dest + i), _mm_packus_epi16(lo, lo));
+    }
+
+    rows_scalar(dest + i, row1 + i, row2 + i, len - i, weights);
+}
+
+#endif
+
+#ifdef HAVE_CPU_DISPATCH
+
+/*
+ * Like column4_sse2(), for pixels +i+ and +i+ + 1 in the two 128-bit lanes.
+ * Returns both pixels' 4 values packed back down to 16 bits.
+ */
+
+__attribute__((target("avx2"))) static inline __m128i
+column4x2_avx2(struct axon_bilinear *b, unsigned char *src, size_t i)
+{
+    __m128i a, c, w;
+    __m256i px, spread, sum;
+    int32_t c00, c10;
+
+    memcpy(&c00, src + b->offsets[i * 2], 4);
+    memcpy(&c10, src + b->offsets[i * 2 + 1], 4);
+    a = _mm_unpacklo_epi8(_mm_cvtsi32_si128(c00), _mm_cvtsi32_si128(c10));
+
+    memcpy(&c00, src + b->offsets[i * 2 + 2], 4);
+    memcpy(&c10, src + b->offsets[i * 2 + 3], 4);
+    c = _mm_unpacklo_epi8(_mm_cvtsi32_si128(c00), _mm_cvtsi32_si128(c10));
+
+    /* both pixels' weights, each spread across its lane */
+    w = _mm_loadl_epi64((__m128i *)(b->weights + i * 2));
+    spread = _mm256_permutevar8x32_epi32(_mm256_castsi128_si256(w),
+					 _mm256_setr_epi32(0, 0, 0, 0,
+							   1, 1, 1, 1));
+
+    px = _mm256_cvtepu8_epi16(_mm_unpacklo_epi64(a, c));
+    sum = _mm256_madd_epi16(px, spread);
+    sum = _mm256_add_epi32(sum, _mm256_set1_epi32(1 << (COLUMN_BITS - 1)));
+    sum = _mm256_srai_epi32(sum, COLUMN_BITS);
+
+    /* The packs work within 128-bit lanes; gather the low quadwords. */
+    sum = _mm256_packs_epi32(sum, sum);
+    return _mm256_castsi256_si128(_mm256_permute4x64_epi64(sum, 0xD8));
+}
+
+__attribute__((target("avx2"))) static void
+columns3_avx2(struct axon_bilinear *b, int16_t *dest, unsigned char *src)
+{
+    __m128i px;
+    size_t i, n;
+
+    n = columns3_safe(b);
+
+    for (i = 0; i + 2 <= n; i += 2) {
+	px = column4x2_avx2(b, src, i);
+	_mm_storel_epi64((__m128i *)(dest + i * 3), px);
+	_mm_storel_epi64((__m128i *)(dest + i * 3 + 3), _mm_srli_si128(px, 8));
+    }
+
+    columns_n(b, dest, src, 3, i);
+}
+
+__attribute__((target("avx2"))) static void
+columns4_avx2(struct axon_bilinear *b, int16_t *dest, unsigned char *src)
+{
+    size_t i;
+
+    for (i = 0; i + 2 <= b->width; i += 2)
+	_mm_storeu_si128((__m128i *)(dest + i * 4), column4x2_avx2(b, src, i));
+
+    columns_n(b, dest, src, 4, i);
+}
+
+__attribute__((target("avx2"))) static void
+rows_avx2(unsigned char *dest, int16_t *row1, int16_t *row2, size_t len,
+	  int32_t weights)
+{
+    __m256i w, round, r1, r2, lo, hi;
+    size_t i;
+
+    w = _mm256_set1_epi32(weights);
+    round = _mm256_set1_epi32(1 << (ROW_SHIFT - 1));
+
+    for (i = 0; i + 16 <= len; i += 16) {
+	r1 = _mm256_loadu_si256((__m256i *)(row1 + i));
+	r2 = _mm256_loadu_si256((__m256i *)(row2 + i));
+
+	lo = _mm256_madd_epi16(_mm256_unpacklo_epi16(r1, r2), w);
+	hi = _mm256_madd_epi16(_mm256_unpackhi_epi16(r1, r2), w);
+	lo = _mm256_srai_epi32(_mm256_add_epi32(lo, round), ROW_SHIFT);
+	hi = _mm256_srai_epi32(_mm256_add_epi32(hi, round), ROW_SHIFT);
+
+	/* The packs work within 128-bit lanes; gather the low quadwords. */
+	lo = _mm256_packs_epi32(lo, hi);
+	lo = _mm256_packus_epi16(lo, lo);
+	lo = _mm256_permute4x64_epi64(lo, 0xD8);
+	_mm_storeu_si128((__m128i *)(dest + i), _mm256_castsi256_si128(lo));
+    }
+
+    rows_scalar(dest + i, row1 + i, row2 + i, len - i, weights);
+}
+
+#endif
+
+#ifdef __ARM_NEON
+
+/* The 4 values from c00 and c10 of pixel +i+, interpolated. */
+
+static inline int16x4_t
+column4_neon(struct axon_bilinear *b, unsigned char *src, size_t i)
+{
+    uint32_t c00, c10;
+    int16x4_t a, c;
+    int32x4_t sum;
+
+    memcpy(&c00, src + b->offsets[i * 2], 4);
+    memcpy(&c10, src + b->offsets[i * 2 + 1], 4);
+
+    a = vreinterpret_s16_u16(vget_low_u16(vmovl_u8(vcreate_u8(c00))));
+    c = vreinterpret_s16_u16(vget_low_u16(vmovl_u8(vcreate_u8(c10))));
+
+    sum = vmull_n_s16(a, b->weights[i * 2]);
+    sum = vmlal_n_s16(sum, c, b->weights[i * 2 + 1]);
+    return vmovn_s32(vrshrq_n_s32(sum, COLUMN_BITS));
+}
+
+static void
+columns1_neon(struct axon_bilinear *b, int16_t *dest, unsigned char *src)
+{
+    int16x4_t c00, c10;
+    int16x4x2_t w;
+    int32x4_t sum;
+    uint32_t *o;
+    size_t i;
+
+    for (i = 0; i + 4 <= b->width; i += 4) {
+	o = b->offsets + i * 2;
+	c00 = vcreate_s16(src[o[0]] | (uint64_t)src[o[2]] << 16 |
+			  (uint64_t)src[o[4]] << 32 | (uint64_t)src[o[6]] << 48);
+	c10 = vcreate_s16(src[o[1]] | (uint64_t)src[o[3]] << 16 |
+			  (uint64_t)src[o[5]] << 32 | (uint64_t)src[o[7]] << 48);
+
+	/* the weights are stored in pairs, vld2 splits them up */
+	w = vld2_s16(b->weights + i * 2);
+	sum = vmull_s16(c00, w.val[0]);
+	sum = vmlal_s16(sum, c10, w.val[1]);
+	vst1_s16(dest + i, vmovn_s32(vrshrq_n_s32(sum, COLUMN_BITS)));
     }
-    
-    return rb_dest_sl;    
+
+    columns_n(b, dest, src, 1, i);
+}
+
+static void
+columns3_neon(struct axon_bilinear *b, int16_t *dest, unsigned char *src)
+{
+    size_t i, n;
+
+    n = columns3_safe(b);
+
+    for (i = 0; i < n; i++)
+	vst1_s16(dest + i * 3, column4_neon(b, src, i));
+
+    columns_n(b, dest, src, 3, i);
+}
+
+static void
+columns4_neon(struct axon_bilinear *b, int16_t *dest, unsigned char *src)
+{
+    size_t i;
+
+    for (i = 0; i < b->width; i++)
+	vst1_s16(dest + i * 4, column4_neon(b, src, i));
+}
+
+static void
+rows_neon(unsigned char *dest, int16_t *row1, int16_t *row2, size_t len,
+	  int32_t weights)
+{
+    int16x4_t w0, w1;
+    int16x8_t r1, r2;
+    int32x4_t lo, hi;
+    size_t i;
+
+    w0 = vdup_n_s16((int16_t)(weights & 0xFFFF));
+    w1 = vdup_n_s16((int16_t)(weights >> 16));
+
+    for (i = 0; i + 8 <= len; i += 8) {
+	r1 = vld1q_s16(row1 + i);
+	r2 = vld1q_s16(row2 + i);
+
+	lo = vmull_s16(vget_low_s16(r1), w0);
+	lo = vmlal_s16(lo, vget_low_s16(r2), w1);
+	hi = vmull_s16(vget_high_s16(r1), w0);
+	hi = vmlal_s16(hi, vget_high_s16(r2), w1);
+
+	lo = vrshrq_n_s32(lo, ROW_SHIFT);
+	hi = vrshrq_n_s32(hi, ROW_SHIFT);
+	vst1_u8(dest + i, vqmovun_s16(vcombine_s16(vmovn_s32(lo),
+						   vmovn_s32(hi))));
+    }
+
+    rows_scalar(dest + i, row1 + i, row2 + i, len - i, weights);
+}
+
+#endif
+
+/*
+ * Interpolates +src+ horizontally into +dest+, which must have room for
+ * width * components values.
+ */
+
+void
+axon_bilinear_columns(struct axon_bilinear *b, int16_t *dest,
+		      unsigned char *src)
+{
+    switch (b->components) {
+    case 1: columns1_kernel(b, dest, src); break;
+    case 3: columns3_kernel(b, dest, src); break;
+    case 4: columns4_kernel(b, dest, src); break;
+    default: columns_n(b, dest, src, b->components, 0);
+    }
+}
+
+/*
+ * Blends two scanlines from axon_bilinear_columns() into +dest+. +ty+ is the
+ * distance of the output scanline from +row1+, between 0 and 1.
+ */
+
+void
+axon_bilinear_rows(struct axon_bilinear *b, unsigned char *dest,
+		   int16_t *row1, int16_t *row2, double ty)
+{
+    int32_t w;
+
+    w = (int32_t)(ty * WEIGHT_ONE + 0.5);
+    rows_kernel(dest, row1, row2, b->width * b->components,
+		(int32_t)((uint32_t)w << 16 | (uint32_t)(WEIGHT_ONE - w)));
+}
+
+/*
+ * Alpha stripping. Scanlines of +components+ color channels followed by an
+ * alpha channel are either cut down to just the color channels, or, if a
+ * +background+ color is given, composited onto it.
+ */
+
+static inline void
+drop_n(unsigned char *dest, unsigned char *src, size_t width,
+       size_t components)
+{
+    size_t i, j;
+
+    for (i = 0; i < width; i++) {
+	for (j = 0; j < components; j++)
+	    *dest++ = *src++;
+	src++;
+    }
+}
+
+static void
+drop4(unsigned char *dest, unsigned char *src, size_t width)
+{
+    drop_n(dest, src, width, 3);
+}
+
+#ifdef HAVE_CPU_DISPATCH
+
+__attribute__((target("ssse3"))) static void
+drop4_ssse3(unsigned char *dest, unsigned char *src, size_t width)
+{
+    __m128i shuffle, px;
+    size_t i;
+
+    shuffle = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14,
+			    -1, -1, -1, -1);
+
+    /* 4 pixels in, 12 bytes out, but each store writes 16 bytes */
+    for (i = 0; i + 6 <= width; i += 4) {
+	px = _mm_loadu_si128((__m128i *)(src + i * 4));
+	_mm_storeu_si128((__m128i *)(dest + i * 3), _mm_shuffle_epi8(px, shuffle));
+    }
+
+    drop_n(dest + i * 3, src + i * 4, width - i, 3);
+}
+
+#endif
+
+/* c * a + bg * (255 - a), divided by 255 and rounded */
+static inline unsigned char
+blend(unsigned char c, unsigned char bg, unsigned char a)
+{
+    uint32_t t = c * a + bg * (255 - a) + 128;
+    return (t + (t >> 8)) >> 8;
+}
+
+static inline void
+flatten_n(unsigned char *dest, unsigned char *src, size_t width,
+	  size_t components, unsigned char *background)
+{
+    unsigned char a;
+    size_t i, j;
+
+    for (i = 0; i < width; i++) {
+	a = src[components];
+	for (j = 0; j < components; j++)
+	    *dest++ = blend(src[j], background[j], a);
+	src += components + 1;
+    }
+}
+
+/*
+ * Writes +width+ pixels of +components+ channels to +dest+, from +src+ which
+ * has an alpha channel after the color channels of each pixel.
+ */
+
+void
+axon_strip_alpha(unsigned char *dest, unsigned char *src, size_t width,
+		 size_t components, unsigned char *background)
+{
+    if (background) {
+	switch (components) {
+	case 1: flatten_n(dest, src, width, 1, background); break;
+	case 3: flatten_n(dest, src, width, 3, background); break;
+	default: flatten_n(dest, src, width, components, background);
+	}
+    } else {
+	switch (components) {
+	case 1: drop_n(dest, src, width, 1); break;
+	case 3: drop4_kernel(dest, src, width); break;
+	default: drop_n(dest, src, width, components);
+	}
+    }
+}
+
+/* :nodoc: */
+
+static VALUE
+strip_alpha(int argc, VALUE *argv, VALUE self)
+{
+    VALUE rb_scanline, rb_components, rb_background, rb_dest, rb_dest_sl;
+    unsigned char *background;
+    size_t components, width;
+
+    rb_scan_args(argc, argv, "22", &rb_scanline, &rb_components,
+		 &rb_background, &rb_dest);
+
+    components = NUM2INT(rb_components);
+    Check_Type(rb_scanline, T_STRING);
+
+    if (components < 2)
+	rb_raise(rb_eArgError, "Scanline has no alpha channel.");
+
+    if (rb_dest == rb_scanline)
+	rb_raise(rb_eArgError, "Can't strip alpha into the source scanline.");
+
+    background = NULL;
+    if (!NIL_P(rb_background)) {
+	Check_Type(rb_background, T_STRING);
+	if ((size_t)RSTRING_LEN(rb_background) != components - 1)
+	    rb_raise(rb_eArgError, "Background color must have %d components.",
+		     (int)components - 1);
+	background = (unsigned char *)RSTRING_PTR(rb_background);
+    }
+
+    width = RSTRING_LEN(rb_scanline) / components;
+    rb_dest_sl = axon_buffer(rb_dest, width * (components - 1));
+
+    axon_strip_alpha((unsigned char *)RSTRING_PTR(rb_dest_sl),
+		     (unsigned char *)RSTRING_PTR(rb_scanline), width,
+		     components - 1, background);
+
+    return rb_dest_sl;
+}
+
+/* How far select_kernels() goes. */
+#define KERNELS_SCALAR 0
+#define KERNELS_BASELINE 1	/* whatever the compiler targets by default */
+#define KERNELS_ALL 2		/* and what we find at runtime */
+
+/*
+ * Picks the fastest kernels this CPU supports, up to +level+.
+ */
+
+static void
+select_kernels(int level)
+{
+    columns1_kernel = columns1;
+    columns3_kernel = columns3;
+    columns4_kernel = columns4;
+    rows_kernel = rows_scalar;
+    drop4_kernel = drop4;
+    kernel_name = "scalar";
+
+    if (level == KERNELS_SCALAR)
+	return;
+
+#ifdef __SSE2__
+    columns1_kernel = columns1_sse2;
+    columns3_kernel = columns3_sse2;
+    columns4_kernel = columns4_sse2;
+    rows_kernel = rows_sse2;
+    kernel_name = "sse2";
+#endif
+
+#ifdef __ARM_NEON
+    columns1_kernel = columns1_neon;
+    columns3_kernel = columns3_neon;
+    columns4_kernel = columns4_neon;
+    rows_kernel = rows_neon;
+    kernel_name = "neon";
+#endif
+
+    if (level == KERNELS_BASELINE)
+	return;
+
+#ifdef HAVE_CPU_DISPATCH
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("ssse3"))
+	drop4_kernel = drop4_ssse3;
+    /* Gathering single bytes is no faster with AVX2, so 1 keeps SSE2's. */
+    if (__builtin_cpu_supports("avx2")) {
+	columns3_kernel = columns3_avx2;
+	columns4_kernel = columns4_avx2;
+	rows_kernel = rows_avx2;
+	kernel_name = "avx2";
+    }
+#endif
 }
 
 /* :nodoc: */
 
 static VALUE
-bilinear(VALUE self, VALUE rb_scanline1, VALUE rb_scanline2, VALUE rb_width,
-	 VALUE rb_ty, VALUE rb_components)
+bilinear(int argc, VALUE *argv, VALUE self)
 {
+    VALUE rb_scanline1, rb_scanline2, rb_width, rb_ty, rb_components, rb_dest;
+    VALUE rb_dest_sl;
+    struct axon_bilinear b;
+    int16_t *row1, *row2;
     double ty;
-    unsigned char *scanline1, *scanline2;
     int src_line_size;
     size_t width, components, src_width;
 
+    rb_scan_args(argc, argv, "51", &rb_scanline1, &rb_scanline2, &rb_width,
+		 &rb_ty, &rb_components, &rb_dest);
+
     width = NUM2INT(rb_width);
     components = NUM2INT(rb_components);
     ty = NUM2DBL(rb_ty);
@@ -87,52 +742,271 @@ bilinear(VALUE self, VALUE rb_scanline1, VALUE rb_scanline2, VALUE rb_width,
     if (RSTRING_LEN(rb_scanline2) != src_line_size)
 	rb_raise(rb_eArgError, "Scanlines don't have the same width.");
 
+    if (rb_dest == rb_scanline1 || rb_dest == rb_scanline2)
+	rb_raise(rb_eArgError, "Can't interpolate into a source scanline.");
+
+    /* the scanlines carry one pixel of padding on the right */
     src_width = src_line_size / components - 1;
-    scanline1 = RSTRING_PTR(rb_scanline1);
-    scanline2 = RSTRING_PTR(rb_scanline2);
+    if (width < 1 || components < 1 || src_width < 1)
+	rb_raise(rb_eArgError, "Scanlines are too short.");
+
+    rb_dest_sl = axon_buffer(rb_dest, width * components);
+
+    axon_bilinear_init(&b, width, src_width, components);
+    row1 = ALLOC_N(int16_t, width * components);
+    row2 = ALLOC_N(int16_t, width * components);
+
+    axon_bilinear_columns(&b, row1, (unsigned char *)RSTRING_PTR(rb_scanline1));
+    axon_bilinear_columns(&b, row2, (unsigned char *)RSTRING_PTR(rb_scanline2));
+    axon_bilinear_rows(&b, (unsigned char *)RSTRING_PTR(rb_dest_sl), row1,
+		       row2, ty);
+
+    xfree(row1);
+    xfree(row2);
+    axon_bilinear_free(&b);
 
-    return bilinear2(width, src_width, components, ty, scanline1, scanline2);
+    return rb_dest_sl;
 }
 
+/* :nodoc: */
+
 static VALUE
-nearest2(size_t width, size_t src_width, size_t components, char *scanline)
+kernel(VALUE self)
 {
-    double inv_scale_x;
+    return rb_str_new2(kernel_name);
+}
+
+/* :nodoc: */
+
+static VALUE
+set_simd(VALUE self, VALUE simd)
+{
+    if (SYMBOL_P(simd) && SYM2ID(simd) == rb_intern("baseline"))
+	select_kernels(KERNELS_BASELINE);
+    else
+	select_kernels(RTEST(simd) ? KERNELS_ALL : KERNELS_SCALAR);
+    return simd;
+}
+
+/*
+ * Area averaging. Every source pixel falls into exactly one output pixel, and
+ * each output pixel is the mean of the source pixels that fell into it. Source
+ * column x lands in output column floor(x * width / src_width), and rows are
+ * binned the same way.
+ *
+ * Scanlines are summed into an accumulator row of width * components 64-bit
+ * integers with axon_area_add(), and axon_area_emit() divides them out once
+ * all the source rows for an output row have been added. 32 bits would
+ * overflow once an output pixel covers more than 16M source pixels.
+ */
+
+/*
+ * Returns the first source row that falls into output row +row+. The rows for
+ * output row +row+ are those from axon_area_first_row(row) up to
+ * axon_area_first_row(row + 1).
+ */
+
+size_t
+axon_area_first_row(size_t row, size_t height, size_t src_height)
+{
+    return (row * src_height + height - 1) / height;
+}
+
+void
+axon_area_init(struct axon_area *a, size_t width, size_t src_width,
+	       size_t components)
+{
+    size_t i, bin;
+
+    a->width = width;
+    a->src_width = src_width;
+    a->components = components;
+    a->bins = ALLOC_N(uint32_t, src_width);
+    a->counts = ALLOC_N(uint32_t, width);
+
+    MEMZERO(a->counts, uint32_t, width);
+
+    for (i = 0; i < src_width; i++) {
+	bin = i * width / src_width;
+	a->bins[i] = bin * components;
+	a->counts[bin]++;
+    }
+}
+
+void
+axon_area_free(struct axon_area *a)
+{
+    xfree(a->bins);
+    xfree(a->counts);
+    a->bins = NULL;
+    a->counts = NULL;
+}
+
+static inline void
+area_add_n(struct axon_area *a, uint64_t *acc, unsigned char *src,
+	   size_t components)
+{
+    uint64_t *bin;
+    size_t i, j;
+
+    for (i = 0; i < a->src_width; i++) {
+	bin = acc + a->bins[i];
+	for (j = 0; j < components; j++)
+	    bin[j] += *src++;
+    }
+}
+
+void
+axon_area_add(struct axon_area *a, uint64_t *acc, unsigned char *src)
+{
+    switch (a->components) {
+    case 1: area_add_n(a, acc, src, 1); break;
+    case 3: area_add_n(a, acc, src, 3); break;
+    case 4: area_add_n(a, acc, src, 4); break;
+    default: area_add_n(a, acc, src, a->components);
+    }
+}
+
+/*
+ * Writes the rounded means of the accumulated +rows+ scanlines to +dest+ and
+ * clears the accumulator for the next output row.
+ */
+
+void
+axon_area_emit(struct axon_area *a, unsigned char *dest, uint64_t *acc,
+	       size_t rows)
+{
+    uint64_t count;
+    size_t i, j;
+
+    for (i = 0; i < a->width; i++) {
+	count = (uint64_t)a->counts[i] * rows;
+	for (j = 0; j < a->components; j++) {
+	    *dest++ = count ? (*acc + count / 2) / count : 0;
+	    *acc++ = 0;
+	}
+    }
+}
+
+/* :nodoc: */
+
+static VALUE
+area_add(VALUE self, VALUE rb_acc, VALUE rb_scanline, VALUE rb_width,
+	 VALUE rb_components)
+{
+    struct axon_area a;
+    size_t width, components, src_width;
+
+    width = NUM2INT(rb_width);
+    components = NUM2INT(rb_components);
+
+    Check_Type(rb_acc, T_STRING);
+    Check_Type(rb_scanline, T_STRING);
+
+    src_width = RSTRING_LEN(rb_scanline) / components;
+    if (width < 1 || src_width < width)
+	rb_raise(rb_eArgError, "Scanline is narrower than the output.");
+
+    if ((size_t)RSTRING_LEN(rb_acc) != width * components * sizeof(uint64_t))
+	rb_raise(rb_eArgError, "Accumulator has the wrong size.");
+
+    rb_str_modify(rb_acc);
+
+    axon_area_init(&a, width, src_width, components);
+    axon_area_add(&a, (uint64_t *)RSTRING_PTR(rb_acc),
+		  (unsigned char *)RSTRING_PTR(rb_scanline));
+    axon_area_free(&a);
+
+    return rb_acc;
+}
+
+/* :nodoc: */
+
+static VALUE
+area_emit(int argc, VALUE *argv, VALUE self)
+{
+    VALUE rb_acc, rb_rows, rb_src_width, rb_width, rb_components, rb_dest;
     VALUE rb_dest_sl;
-    char *dest_sl, *xpos;
+    struct axon_area a;
+    size_t width, components, src_width, rows;
+
+    rb_scan_args(argc, argv, "51", &rb_acc, &rb_rows, &rb_src_width,
+		 &rb_width, &rb_components, &rb_dest);
+
+    width = NUM2INT(rb_width);
+    src_width = NUM2INT(rb_src_width);
+    components = NUM2INT(rb_components);
+    rows = NUM2INT(rb_rows);
+
+    Check_Type(rb_acc, T_STRING);
+
+    if (width < 1 || src_width < width)
+	rb_raise(rb_eArgError, "Source is narrower than the output.");
+
+    if ((size_t)RSTRING_LEN(rb_acc) != width * components * sizeof(uint64_t))
+	rb_raise(rb_eArgError, "Accumulator has the wrong size.");
+
+    if (rb_dest == rb_acc)
+	rb_raise(rb_eArgError, "Can't average into the accumulator.");
+
+    rb_str_modify(rb_acc);
+    rb_dest_sl = axon_buffer(rb_dest, width * components);
+
+    axon_area_init(&a, width, src_width, components);
+    axon_area_emit(&a, (unsigned char *)RSTRING_PTR(rb_dest_sl),
+		   (uint64_t *)RSTRING_PTR(rb_acc), rows);
+    axon_area_free(&a);
+
+    return rb_dest_sl;
+}
+
+void
+axon_nearest_row(unsigned char *dest_sl, size_t width, size_t src_width,
+		 size_t components, unsigned char *scanline)
+{
+    double inv_scale_x;
+    unsigned char *xpos;
     size_t i, j;
-    
-    inv_scale_x = (double)src_width / width;
 
-    rb_dest_sl = rb_str_new(0, width * components);
-    dest_sl = RSTRING_PTR(rb_dest_sl);
+    inv_scale_x = (double)src_width / width;
 
     for (i = 0; i < width; i++) {
 	xpos = scanline + (int)(i * inv_scale_x) * components;
 	for (j = 0; j < components; j++)
             *dest_sl++ = *xpos++;
     }
-
-    return rb_dest_sl;    
 }
 
 /* :nodoc: */
 
 static VALUE
-nearest(VALUE self, VALUE rb_scanline, VALUE rb_width, VALUE rb_components)
+nearest(int argc, VALUE *argv, VALUE self)
 {
+    VALUE rb_scanline, rb_width, rb_components, rb_dest, rb_dest_sl;
     unsigned char *scanline;
     size_t width, src_width, src_line_size, components;
 
+    rb_scan_args(argc, argv, "31", &rb_scanline, &rb_width, &rb_components,
+		 &rb_dest);
+
     width = NUM2INT(rb_width);
     components = NUM2INT(rb_components);
 
     Check_Type(rb_scanline, T_STRING);
+
+    if (rb_dest == rb_scanline)
+	rb_raise(rb_eArgError, "Can't interpolate into a source scanline.");
+
+    rb_dest_sl = axon_buffer(rb_dest, width * components);
+
     src_line_size = RSTRING_LEN(rb_scanline);
     scanline = RSTRING_PTR(rb_scanline);
-
     src_width = src_line_size / components;
-    return nearest2(width, src_width, components, scanline);
+
+    axon_nearest_row((unsigned char *)RSTRING_PTR(rb_dest_sl), width,
+		     src_width, components, scanline);
+
+    return rb_dest_sl;
 }
 
 
@@ -142,6 +1016,13 @@ Init_Interpolation()
     VALUE mAxon = rb_define_module("Axon");
     /* :nodoc: */
     VALUE mInterpolation = rb_define_module_under(mAxon, "Interpolation");
-    rb_define_singleton_method(mInterpolation, "bilinear", bilinear, 5);
-    rb_define_singleton_method(mInterpolation, "nearest", nearest, 3);
+    rb_define_singleton_method(mInterpolation, "bilinear", bilinear, -1);
+    rb_define_singleton_method(mInterpolation, "nearest", nearest, -1);
+    rb_define_singleton_method(mInterpolation, "area_add", area_add, 4);
+    rb_define_singleton_method(mInterpolation, "area_emit", area_emit, -1);
+    rb_define_singleton_method(mInterpolation, "strip_alpha", strip_alpha, -1);
+    rb_define_singleton_method(mInterpolation, "kernel", kernel, 0);
+    rb_define_singleton_method(mInterpolation, "simd=", set_simd, 1);
+
+    select_kernels(KERNELS_ALL);
 }
@@ -0,0 +1,776 @@
+#include "axon.h"
+
+static ID id_gets, id_push_down, id_width, id_height, id_components, id_lineno, id_scaler,
+	  id_iv_source, id_iv_lineno, id_iv_x_offset, id_iv_y_offset,
+	  id_iv_color, id_iv_background, id_iv_source_x;
+
+static VALUE buffered_gets;
+
+static VALUE cImage, cFit, cCropper, cAlphaStripper, cBilinearScaler,
+	     cNearestNeighborScaler, cAreaScaler, cSolid;
+
+/*
+ * The image stages are defined in Ruby, after the extension has been loaded,
+ * so we look them up the first time a pipeline is built.
+ */
+
+static void
+resolve_class(VALUE *klass, const char *name)
+{
+    VALUE mAxon;
+    ID id;
+
+    if (*klass)
+	return;
+
+    mAxon = rb_const_get(rb_cObject, rb_intern("Axon"));
+    id = rb_intern(name);
+    if (rb_const_defined_at(mAxon, id))
+	*klass = rb_const_get_at(mAxon, id);
+}
+
+static void
+resolve_classes()
+{
+    resolve_class(&cImage, "Image");
+    resolve_class(&cFit, "Fit");
+    resolve_class(&cCropper, "Cropper");
+    resolve_class(&cAlphaStripper, "AlphaStripper");
+    resolve_class(&cBilinearScaler, "BilinearScaler");
+    resolve_class(&cNearestNeighborScaler, "NearestNeighborScaler");
+    resolve_class(&cAreaScaler, "AreaScaler");
+    resolve_class(&cSolid, "Solid");
+    resolve_class(&buffered_gets, "BUFFERED_GETS");
+}
+
+/*
+ * Raises +message+, or hands it back to axon_pipeline_read_strip() if we are
+ * reading without the GVL.
+ */
+
+static void
+fail(struct axon_source *src, const char *message)
+{
+    struct axon_pipeline *pipeline = src->pipeline;
+
+    if (pipeline && pipeline->nogvl) {
+	pipeline->error = message;
+	longjmp(pipeline->jmp, 1);
+    }
+
+    rb_raise(rb_eRuntimeError, "%s", message);
+}
+
+static VALUE
+read_ahead(VALUE arg)
+{
+    struct axon_source *src = (struct axon_source *)arg;
+    size_t lineno = src->lineno, n = src->height - src->lineno, i, row_len;
+
+    if (n > AXON_STRIP_ROWS)
+	n = AXON_STRIP_ROWS;
+
+    if (src->read_strip) {
+	src->read_strip(src, src->ahead, n);
+    } else {
+	row_len = src->width * src->components;
+	for (i = 0; i < n; i++)
+	    src->read_row(src, src->ahead + i * row_len);
+    }
+
+    src->lineno = lineno;
+    src->ahead_rows = n;
+    src->ahead_pos = 0;
+
+    return Qnil;
+}
+
+/*
+ * Decoders and Ruby sources need the GVL, so when the pipeline runs without it
+ * we take the GVL back once per strip to read ahead and then hand out rows from
+ * that strip.
+ */
+
+static void
+pull_ahead(struct axon_source *src, unsigned char *row)
+{
+    struct axon_pipeline *pipeline = src->pipeline;
+    size_t row_len = src->width * src->components;
+
+    if (src->ahead_pos == src->ahead_rows) {
+	pipeline->tag = axon_protect(1, read_ahead, (VALUE)src);
+	if (pipeline->tag)
+	    longjmp(pipeline->jmp, 1);
+    }
+
+    memcpy(row, src->ahead + src->ahead_pos * row_len, row_len);
+    src->ahead_pos++;
+    src->lineno++;
+}
+
+static void
+pull(struct axon_source *src, unsigned char *row)
+{
+    if (src->lineno >= src->height)
+	fail(src, "Source image ran out of scanlines.");
+
+    if (src->ahead)
+	pull_ahead(src, row);
+    else
+	src->read_row(src, row);
+}
+
+static void
+pull_strip(struct axon_source *src, unsigned char *strip, size_t n)
+{
+    size_t i, row_len;
+
+    if (src->lineno + n > src->height)
+	fail(src, "Source image ran out of scanlines.");
+
+    if (src->read_strip) {
+	src->read_strip(src, strip, n);
+	return;
+    }
+
+    row_len = src->width * src->components;
+    for (i = 0; i < n; i++)
+	src->read_row(src, strip + i * row_len);
+}
+
+/* Without the GVL this waits for axon_pipeline_read_strip() to sync. */
+
+static void
+sync_lineno(struct axon_source *src)
+{
+    if (!src->pipeline || !src->pipeline->nogvl)
+	rb_ivar_set(src->obj, id_iv_lineno, SIZET2NUM(src->lineno));
+}
+
+static void
+free_sources(struct axon_source *src)
+{
+    struct axon_source *upstream;
+
+    while (src) {
+	upstream = src->upstream;
+	if (src->free)
+	    src->free(src);
+	xfree(src->buf1);
+	xfree(src->buf2);
+	xfree(src->ahead);
+	if (src->buffer)
+	    rb_gc_unregister_address(&src->buffer);
+	xfree(src);
+	src = upstream;
+    }
+}
+
+static void
+query_dimensions(struct axon_source *src)
+{
+    src->width = NUM2INT(rb_funcall(src->obj, id_width, 0));
+    src->height = NUM2INT(rb_funcall(src->obj, id_height, 0));
+    src->components = NUM2INT(rb_funcall(src->obj, id_components, 0));
+}
+
+/* Ruby Sources -- anything we don't recognize goes through #gets */
+
+static void
+ruby_read_row(struct axon_source *src, unsigned char *row)
+{
+    VALUE sl;
+    size_t len;
+
+    len = src->width * src->components;
+    if (src->buffer)
+	sl = rb_funcall(src->obj, id_gets, 1, src->buffer);
+    else
+	sl = rb_funcall(src->obj, id_gets, 0);
+
+    if (TYPE(sl) != T_STRING)
+	sl = rb_obj_as_string(sl);
+
+    if ((size_t)RSTRING_LEN(sl) != len)
+	rb_raise(rb_eRuntimeError, "Scanline has a bad size. Expected %d but got %d.",
+		 (int)len, (int)RSTRING_LEN(sl));
+
+    memcpy(row, RSTRING_PTR(sl), len);
+    src->lineno++;
+}
+
+/*
+ * Stages that can read into a buffer get the same string back on every call,
+ * so pulling rows through them doesn't allocate.
+ */
+
+static void
+ruby_source(struct axon_source *src)
+{
+    src->read_row = ruby_read_row;
+    query_dimensions(src);
+
+    if (buffered_gets &&
+	RTEST(rb_hash_aref(buffered_gets, rb_obj_class(src->obj)))) {
+	src->buffer = rb_str_new(0, src->width * src->components);
+	rb_gc_register_address(&src->buffer);
+    }
+}
+
+/*
+ * Native stages reproduce their Ruby counterparts, which assume that nothing
+ * has been read from them or from their source yet.
+ */
+
+static int
+is_fresh(struct axon_source *src)
+{
+    if (src->read_row == ruby_read_row)
+	return rb_funcall(src->obj, id_lineno, 0) == INT2FIX(0);
+    return src->lineno == 0;
+}
+
+/* Solid */
+
+static void
+solid_read_row(struct axon_source *src, unsigned char *row)
+{
+    size_t i;
+
+    for (i = 0; i < src->width; i++) {
+	memcpy(row, src->buf1, src->components);
+	row += src->components;
+    }
+
+    src->lineno++;
+    sync_lineno(src);
+}
+
+static int
+solid_source(struct axon_source *src)
+{
+    VALUE color, lineno;
+
+    color = rb_ivar_get(src->obj, id_iv_color);
+    lineno = rb_ivar_get(src->obj, id_iv_lineno);
+    if (TYPE(color) != T_STRING || !FIXNUM_P(lineno))
+	return 0;
+
+    query_dimensions(src);
+    if (src->components != (size_t)RSTRING_LEN(color))
+	return 0;
+
+    src->read_row = solid_read_row;
+    src->native = 1;
+    src->lineno = FIX2LONG(lineno);
+    src->buf1 = ALLOC_N(unsigned char, src->components);
+    memcpy(src->buf1, RSTRING_PTR(color), src->components);
+
+    return 1;
+}
+
+/* Cropper */
+
+static void
+cropper_read_row(struct axon_source *src, unsigned char *row)
+{
+    struct axon_source *up = src->upstream;
+    size_t cmp = src->components;
+
+    while (up->lineno < src->y_offset)
+	pull(up, src->buf1);
+
+    pull(up, src->buf1);
+    memcpy(row, src->buf1 + src->x_offset * cmp, src->width * cmp);
+
+    src->lineno++;
+    sync_lineno(src);
+}
+
+/*
+ * A Cropper reads past rows it doesn't need, so its source only has to be
+ * above the cropped area. A JPEG::Reader that skipped rows will be exactly at
+ * the top of it.
+ */
+
+static int
+cropper_ready(struct axon_source *src)
+{
+    struct axon_source *up = src->upstream;
+
+    if (up->read_row == ruby_read_row)
+	return is_fresh(up);
+
+    return up->lineno <= (size_t)NUM2INT(rb_ivar_get(src->obj, id_iv_y_offset));
+}
+
+static void
+cropper_source(struct axon_source *src)
+{
+    struct axon_source *up = src->upstream;
+
+    src->read_row = cropper_read_row;
+    src->x_offset = NUM2INT(rb_ivar_get(src->obj, id_iv_x_offset)) -
+		    NUM2INT(rb_ivar_get(src->obj, id_iv_source_x));
+    src->y_offset = NUM2INT(rb_ivar_get(src->obj, id_iv_y_offset));
+    src->buf1 = ALLOC_N(unsigned char, up->width * up->components);
+}
+
+/* AlphaStripper */
+
+static void
+alpha_stripper_read_row(struct axon_source *src, unsigned char *row)
+{
+    struct axon_source *up = src->upstream;
+
+    if (up->components == src->components) {
+	pull(up, row);
+    } else {
+	pull(up, src->buf1);
+	axon_strip_alpha(row, src->buf1, src->width, src->components,
+			 src->buf2);
+    }
+
+    src->lineno++;
+}
+
+static void
+alpha_stripper_source(struct axon_source *src)
+{
+    struct axon_source *up = src->upstream;
+    VALUE background;
+
+    src->read_row = alpha_stripper_read_row;
+    src->lineno = up->lineno;
+    src->buf1 = ALLOC_N(unsigned char, up->width * up->components);
+
+    /* buf2 holds the background color, if we are flattening */
+    background = rb_ivar_get(src->obj, id_iv_background);
+    if (!NIL_P(background) && up->components != src->components) {
+	StringValue(background);
+	if ((size_t)RSTRING_LEN(background) != src->components)
+	    rb_raise(rb_eArgError, "Background color must have %d components.",
+		     (int)src->components);
+	src->buf2 = ALLOC_N(unsigned char, src->components);
+	memcpy(src->buf2, RSTRING_PTR(background), src->components);
+    }
+}
+
+/* NearestNeighborScaler */
+
+static void
+nearest_read_row(struct axon_source *src, unsigned char *row)
+{
+    struct axon_source *up = src->upstream;
+    size_t sample;
+
+    sample = (size_t)((double)(src->lineno * up->height) / src->height);
+
+    if (src->lineno == 0)
+	pull(up, src->buf1);
+
+    while (up->lineno < sample + 1)
+	pull(up, src->buf1);
+
+    axon_nearest_row(row, src->width, up->width, src->components, src->buf1);
+
+    src->lineno++;
+    sync_lineno(src);
+}
+
+static void
+nearest_source(struct axon_source *src)
+{
+    struct axon_source *up = src->upstream;
+
+    src->read_row = nearest_read_row;
+    src->buf1 = ALLOC_N(unsigned char, up->width * up->components);
+}
+
+/*
+ * BilinearScaler
+ *
+ * Each source scanline is interpolated horizontally as soon as it is read, so
+ * that work is shared by every output scanline that samples it.
+ */
+
+struct bilinear_data {
+    struct axon_bilinear table;
+    int16_t *row1, *row2;
+};
+
+static void
+bilinear_pull(struct axon_source *src, int16_t *dest)
+{
+    struct bilinear_data *data = (struct bilinear_data *)src->data;
+
+    pull(src->upstream, src->buf1);
+    axon_bilinear_columns(&data->table, dest, src->buf1);
+}
+
+static void
+bilinear_read_row(struct axon_source *src, unsigned char *row)
+{
+    struct axon_source *up = src->upstream;
+    struct bilinear_data *data = (struct bilinear_data *)src->data;
+    size_t row_size = src->width * src->components * sizeof(int16_t);
+    int16_t *tmp;
+    double sample, ty;
+    size_t sample_i;
+
+    sample = (double)(src->lineno * up->height) / src->height;
+    sample_i = (size_t)sample;
+    ty = sample - sample_i;
+
+    if (src->lineno == 0) {
+	bilinear_pull(src, data->row2);
+	memcpy(data->row1, data->row2, row_size);
+    }
+
+    while (up->lineno < sample_i + 2) {
+	if (up->lineno < up->height) {
+	    tmp = data->row1;
+	    data->row1 = data->row2;
+	    data->row2 = tmp;
+	    bilinear_pull(src, data->row2);
+	} else {
+	    memcpy(data->row1, data->row2, row_size);
+	    break;
+	}
+    }
+
+    axon_bilinear_rows(&data->table, row, data->row1, data->row2, ty);
+
+    src->lineno++;
+    sync_lineno(src);
+}
+
+static void
+bilinear_free(struct axon_source *src)
+{
+    struct bilinear_data *data = (struct bilinear_data *)src->data;
+
+    axon_bilinear_free(&data->table);
+    xfree(data->row1);
+    xfree(data->row2);
+    xfree(data);
+}
+
+static void
+bilinear_source(struct axon_source *src)
+{
+    struct axon_source *up = src->upstream;
+    struct bilinear_data *data;
+    size_t len = src->width * src->components;
+
+    data = ALLOC(struct bilinear_data);
+    data->row1 = ALLOC_N(int16_t, len);
+    data->row2 = ALLOC_N(int16_t, len);
+    axon_bilinear_init(&data->table, src->width, up->width, src->components);
+
+    src->data = data;
+    src->free = bilinear_free;
+    src->read_row = bilinear_read_row;
+    src->buf1 = ALLOC_N(unsigned char, up->width * up->components);
+}
+
+/* AreaScaler */
+
+struct area_data {
+    struct axon_area table;
+    uint64_t *acc;
+};
+
+static void
+area_read_row(struct axon_source *src, unsigned char *row)
+{
+    struct axon_source *up = src->upstream;
+    struct area_data *data = (struct area_data *)src->data;
+    size_t last, rows;
+
+    last = axon_area_first_row(src->lineno + 1, src->height, up->height);
+
+    for (rows = 0; up->lineno < last; rows++) {
+	pull(up, src->buf1);
+	axon_area_add(&data->table, data->acc, src->buf1);
+    }
+
+    axon_area_emit(&data->table, row, data->acc, rows);
+
+    src->lineno++;
+    sync_lineno(src);
+}
+
+static void
+area_free(struct axon_source *src)
+{
+    struct area_data *data = (struct area_data *)src->data;
+
+    axon_area_free(&data->table);
+    xfree(data->acc);
+    xfree(data);
+}
+
+static void
+area_source(struct axon_source *src)
+{
+    struct axon_source *up = src->upstream;
+    struct area_data *data;
+    size_t len = src->width * src->components;
+
+    if (src->width > up->width || src->height > up->height)
+	rb_raise(rb_eArgError, "AreaScaler can only shrink images.");
+
+    data = ALLOC(struct area_data);
+    data->acc = ALLOC_N(uint64_t, len);
+    MEMZERO(data->acc, uint64_t, len);
+    axon_area_init(&data->table, src->width, up->width, src->components);
+
+    src->data = data;
+    src->free = area_free;
+    src->read_row = area_read_row;
+    src->buf1 = ALLOC_N(unsigned char, up->width * up->components);
+}
+
+/* Building the chain */
+
+static struct axon_source *
+new_source(struct axon_source **slot, VALUE obj)
+{
+    struct axon_source *src;
+
+    src = ALLOC(struct axon_source);
+    MEMZERO(src, struct axon_source, 1);
+    src->obj = obj;
+    *slot = src;
+
+    return src;
+}
+
+static void build(struct axon_source **slot, VALUE obj);
+
+static int
+stage_source(struct axon_source *src, VALUE klass)
+{
+    struct axon_source *up;
+
+    if (klass != cAlphaStripper &&
+	rb_ivar_get(src->obj, id_iv_lineno) != INT2FIX(0))
+	return 0;
+
+    /* a Cropper may hand its window to a JPEG::Reader first */
+    if (klass == cCropper)
+	rb_funcall(src->obj, id_push_down, 0);
+
+    build(&src->upstream, rb_ivar_get(src->obj, id_iv_source));
+    up = src->upstream;
+
+    if (klass == cCropper ? !cropper_ready(src) : !is_fresh(up)) {
+	free_sources(up);
+	src->upstream = NULL;
+	return 0;
+    }
+
+    query_dimensions(src);
+
+    if (src->components != up->components &&
+	(klass != cAlphaStripper || src->components + 1 != up->components))
+	rb_raise(rb_eRuntimeError, "Stage components don't match its source.");
+
+    if (klass == cCropper)
+	cropper_source(src);
+    else if (klass == cAlphaStripper)
+	alpha_stripper_source(src);
+    else if (klass == cNearestNeighborScaler)
+	nearest_source(src);
+    else if (klass == cAreaScaler)
+	area_source(src);
+    else
+	bilinear_source(src);
+
+    src->native = 1;
+    return 1;
+}
+
+static void
+build(struct axon_source **slot, VALUE obj)
+{
+    struct axon_source *src;
+    VALUE klass;
+
+    resolve_classes();
+    klass = rb_obj_class(obj);
+
+    /* Image and Fit only hand rows through from the stage they wrap. */
+    if (klass == cImage) {
+	build(slot, rb_ivar_get(obj, id_iv_source));
+	return;
+    } else if (klass == cFit) {
+	build(slot, rb_funcall(obj, id_scaler, 0));
+	return;
+    }
+
+    src = new_source(slot, obj);
+
+    if (axon_jpeg_source(src, obj) || axon_png_source(src, obj))
+	return;
+
+    if (klass == cSolid && solid_source(src))
+	return;
+
+    if ((klass == cCropper || klass == cAlphaStripper ||
+	 klass == cBilinearScaler || klass == cNearestNeighborScaler ||
+	 klass == cAreaScaler) &&
+	stage_source(src, klass))
+	return;
+
+    ruby_source(src);
+}
+
+void
+axon_pipeline_init(struct axon_pipeline *pipeline)
+{
+    pipeline->head = NULL;
+    pipeline->strip = NULL;
+    pipeline->row_len = 0;
+    pipeline->strip_height = 0;
+    pipeline->nogvl = 0;
+    pipeline->tag = 0;
+    pipeline->error = NULL;
+}
+
+/*
+ * Builds a native pipeline for +image+. Writers pass in the scanline size they
+ * configured themselves with so that a misbehaving image can't overrun the
+ * strip buffer, and the most rows they will ask for at a time.
+ */
+
+void
+axon_pipeline_build(struct axon_pipeline *pipeline, VALUE image,
+		    size_t row_len, size_t strip_height)
+{
+    struct axon_source *head, *src;
+
+    build(&pipeline->head, image);
+    head = pipeline->head;
+
+    if (head->width * head->components != row_len)
+	rb_raise(rb_eRuntimeError, "Scanline has a bad size. Expected %d but got %d.",
+		 (int)row_len, (int)(head->width * head->components));
+
+    pipeline->strip = ALLOC_N(unsigned char, row_len * strip_height);
+    pipeline->row_len = row_len;
+    pipeline->strip_height = strip_height;
+
+    /* Only worth it if there is a native stage to run without the GVL. */
+    pipeline->nogvl = head->native;
+
+    for (src = head; src; src = src->upstream) {
+	src->pipeline = pipeline;
+	if (pipeline->nogvl && !src->native)
+	    src->ahead = ALLOC_N(unsigned char, src->width * src->components *
+				 AXON_STRIP_ROWS);
+    }
+}
+
+struct strip_call {
+    struct axon_pipeline *pipeline;
+    size_t n;
+};
+
+static void *
+read_strip_nogvl(void *arg)
+{
+    struct strip_call *call = (struct strip_call *)arg;
+    struct axon_pipeline *pipeline = call->pipeline;
+
+    if (setjmp(pipeline->jmp))
+	return NULL;
+
+    pull_strip(pipeline->head, pipeline->strip, call->n);
+    return NULL;
+}
+
+static void
+sync_sources(struct axon_source *src)
+{
+    for (; src; src = src->upstream)
+	if (src->native && src->read_row != alpha_stripper_read_row)
+	    rb_ivar_set(src->obj, id_iv_lineno, SIZET2NUM(src->lineno));
+}
+
+/*
+ * Reads the next +n+ rows of the image into the pipeline's strip buffer and
+ * returns it. If the pipeline allows it the rows are read without the GVL.
+ */
+
+unsigned char *
+axon_pipeline_read_strip(struct axon_pipeline *pipeline, size_t n)
+{
+    struct strip_call call;
+    int tag;
+
+    if (n > pipeline->strip_height)
+	rb_raise(rb_eRuntimeError, "Strip is too tall.");
+
+    if (!pipeline->nogvl) {
+	pull_strip(pipeline->head, pipeline->strip, n);
+	return pipeline->strip;
+    }
+
+    call.pipeline = pipeline;
+    call.n = n;
+    pipeline->tag = 0;
+    pipeline->error = NULL;
+    axon_nogvl(read_strip_nogvl, &call);
+    sync_sources(pipeline->head);
+
+    if (pipeline->tag) {
+	tag = pipeline->tag;
+	pipeline->tag = 0;
+	rb_jump_tag(tag);
+    }
+
+    if (pipeline->error)
+	rb_raise(rb_eRuntimeError, "%s", pipeline->error);
+
+    return pipeline->strip;
+}
+
+void
+axon_pipeline_free(struct axon_pipeline *pipeline)
+{
+    free_sources(pipeline->head);
+    xfree(pipeline->strip);
+    axon_pipeline_init(pipeline);
+}
+
+void
+Init_Pipeline()
+{
+    id_gets = rb_intern("gets");
+    id_push_down = rb_intern("push_down");
+    id_width = rb_intern("width");
+    id_height = rb_intern("height");
+    id_components = rb_intern("components");
+    id_lineno = rb_intern("lineno");
+    id_scaler = rb_intern("scaler");
+
+    id_iv_source = rb_intern("@source");
+    id_iv_lineno = rb_intern("@lineno");
+    id_iv_x_offset = rb_intern("@x_offset");
+    id_iv_y_offset = rb_intern("@y_offset");
+    id_iv_color = rb_intern("@color");
+    id_iv_background = rb_intern("@background");
+    id_iv_source_x = rb_intern("@source_x");
+
+    rb_gc_register_address(&cImage);
+    rb_gc_register_address(&cFit);
+    rb_gc_register_address(&cCropper);
+    rb_gc_register_address(&cAlphaStripper);
+    rb_gc_register_address(&cBilinearScaler);
+    rb_gc_register_address(&cNearestNeighborScaler);
+    rb_gc_register_address(&cAreaScaler);
+    rb_gc_register_address(&cSolid);
+    rb_gc_register_address(&buffered_gets);
+}
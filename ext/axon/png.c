@@ -1,19 +1,65 @@
-#include <ruby.h>
+#include "axon.h"
+#include <stdio.h>
 #include <png.h>
+#include <zlib.h>
+
+/* Default sizes of the IO buffers, see the :bufsize options. */
+#define WRITE_BUFSIZE 8192
+#define READ_BUFSIZE 8192
 
 static ID id_write, id_GRAYSCALE, id_GRAYSCALE_ALPHA, id_RGB, id_RGB_ALPHA,
 	  id_gets, id_width, id_height, id_color_model, id_components, id_read;
 
+static ID id_none, id_sub, id_up, id_avg, id_paeth, id_adaptive, id_default,
+	  id_filtered, id_huffman_only, id_rle, id_fixed, id_fast, id_small;
+static VALUE sym_bufsize, sym_compression, sym_strategy, sym_filter,
+	     sym_preset, sym_threads, sym_size_hint;
+static VALUE cPNGReader, cPNGDecoder;
+
+/*
+ * Error state for a single png struct. libpng errors longjmp back to the
+ * caller through png_jmpbuf(), which may be running without the GVL, and are
+ * raised from there.
+ */
+
+struct perr {
+    char message[256];
+    int tag;    /* pending exception from a Ruby callback */
+    int nogvl;  /* set while libpng runs without the GVL */
+};
+
+/* State of a Reader that is fed with <<, see push() */
+struct png_push {
+    struct axon_rows rows;	/* decoded rows not read yet */
+    int header;			/* push_info() has run */
+    int interlaced;		/* rows are combined in place, see push_row() */
+};
+
 struct png_data {
     png_structp png_ptr;
     png_infop info_ptr;
+    struct perr err;
     size_t lineno;
     VALUE io;
+    struct axon_file mem;	/* io, when it is a String */
+
+    /* read-ahead buffer for IO sources */
+    png_bytep buf;
+    size_t bufsize, buf_pos, buf_len;
+
+    struct png_push *push;
 };
 
+/* Small libpng writes are collected in +buf+ before we call io.write. */
 struct io_write {
     VALUE io;
     size_t total;
+    png_bytep buf;
+    size_t bufsize, buf_len;
+    png_bytep data;
+    png_size_t length;
+    int string;		/* io is a String filled in place, see PNG.encode */
+    struct axon_fd out;	/* io is a File we write to directly */
 };
 
 static int
@@ -58,7 +104,10 @@ get_components(png_structp png_ptr, png_infop info_ptr)
 static void
 png_error_fn(png_structp png_ptr, png_const_charp message)
 {
-    rb_raise(rb_eRuntimeError, "pnglib: %s", message);
+    struct perr *err = (struct perr *)png_get_error_ptr(png_ptr);
+
+    snprintf(err->message, sizeof(err->message), "%s", message);
+    longjmp(png_jmpbuf(png_ptr), 1);
 }
 
 static void
@@ -67,50 +116,303 @@ png_warning_fn(png_structp png_ptr, png_const_charp message)
     /* do nothing */
 }
 
-void
-write_data(png_structp png_ptr, png_bytep data, png_size_t length)
+static void
+init_perr(struct perr *err)
+{
+    err->message[0] = '\0';
+    err->tag = 0;
+    err->nogvl = 0;
+}
+
+/*
+ * Raises the error that made libpng longjmp back to us. This is either an
+ * exception caught in one of our IO callbacks or a libpng error message.
+ */
+
+static void
+raise_perr(struct perr *err)
+{
+    int tag = err->tag;
+
+    if (tag) {
+	err->tag = 0;
+	rb_jump_tag(tag);
+    }
+
+    rb_raise(rb_eRuntimeError, "pnglib: %s", err->message);
+}
+
+/*
+ * Calls into Ruby from a libpng callback. Exceptions are handed back to
+ * whoever called into libpng by way of the error state.
+ */
+
+static void
+pcallback(png_structp png_ptr, VALUE (*fn)(VALUE), VALUE arg)
 {
+    struct perr *err = (struct perr *)png_get_error_ptr(png_ptr);
+
+    err->tag = axon_protect(err->nogvl, fn, arg);
+    if (err->tag)
+	longjmp(png_jmpbuf(png_ptr), 1);
+}
+
+struct pcall {
+    png_structp png_ptr;
+    png_infop info_ptr;
+    void (*fn)(struct pcall *call);
+    png_bytep rows;
+    size_t num_rows;
+    int failed;
+};
+
+static void *
+pcall_nogvl(void *arg)
+{
+    struct pcall *call = (struct pcall *)arg;
+
+    if (setjmp(png_jmpbuf(call->png_ptr))) {
+	call->failed = 1;
+	return NULL;
+    }
+
+    call->fn(call);
+    return NULL;
+}
+
+/*
+ * Runs the libpng operation +fn+ without the GVL, raising any error it hits
+ * once we are holding the GVL again.
+ *
+ * This arms png_jmpbuf() in a frame that is gone by the time we return, so
+ * callers have to arm it again before calling libpng directly.
+ */
+
+static void
+pcall(png_structp png_ptr, png_infop info_ptr, void (*fn)(struct pcall *),
+      png_bytep rows, size_t num_rows)
+{
+    struct perr *err = (struct perr *)png_get_error_ptr(png_ptr);
+    struct pcall call;
+
+    call.png_ptr = png_ptr;
+    call.info_ptr = info_ptr;
+    call.fn = fn;
+    call.rows = rows;
+    call.num_rows = num_rows;
+    call.failed = 0;
+
+    if (err->nogvl)
+	rb_raise(rb_eRuntimeError, "pnglib: already in use by another thread.");
+
+    err->nogvl = 1;
+    axon_nogvl(pcall_nogvl, &call);
+    err->nogvl = 0;
+
+    if (call.failed)
+	raise_perr(err);
+}
+
+/* Row operations work through a packed strip of +num_rows+ rows per trip. */
+
+static void
+do_write_rows(struct pcall *call)
+{
+    size_t i, rowbytes;
+
+    rowbytes = png_get_rowbytes(call->png_ptr, call->info_ptr);
+    for (i = 0; i < call->num_rows; i++)
+	png_write_row(call->png_ptr, call->rows + i * rowbytes);
+}
+
+static void
+do_write_end(struct pcall *call)
+{
+    png_write_end(call->png_ptr, call->info_ptr);
+}
+
+static void
+do_read_rows(struct pcall *call)
+{
+    size_t i, rowbytes;
+
+    rowbytes = png_get_rowbytes(call->png_ptr, call->info_ptr);
+    for (i = 0; i < call->num_rows; i++)
+	png_read_row(call->png_ptr, call->rows + i * rowbytes, (png_bytep)NULL);
+}
+
+static void
+do_read_end(struct pcall *call)
+{
+    png_read_end(call->png_ptr, call->info_ptr);
+}
+
+/* +rows+ is a chunk of PNG data here, +num_rows+ its length. */
+
+static void
+do_process_data(struct pcall *call)
+{
+    png_process_data(call->png_ptr, call->info_ptr, call->rows,
+		     call->num_rows);
+}
+
+static size_t
+bufsize_option(VALUE options, size_t bufsize)
+{
+    VALUE rb_bufsize;
+    long size;
+
+    if (NIL_P(options) || TYPE(options) != T_HASH)
+	return bufsize;
+
+    rb_bufsize = rb_hash_aref(options, sym_bufsize);
+    if (NIL_P(rb_bufsize))
+	return bufsize;
+
+    size = NUM2LONG(rb_bufsize);
+    if (size < 1)
+	rb_raise(rb_eRuntimeError, "Buffer size must be greater than zero");
+
+    return (size_t)size;
+}
+
+static size_t
+size_hint_option(VALUE options)
+{
+    VALUE rb_hint;
+    long hint;
+
+    if (NIL_P(options) || TYPE(options) != T_HASH)
+	return 0;
+
+    rb_hint = rb_hash_aref(options, sym_size_hint);
+    if (NIL_P(rb_hint))
+	return 0;
+
+    hint = NUM2LONG(rb_hint);
+    if (hint < 0)
+	rb_raise(rb_eRuntimeError, "Size hint can't be negative");
+
+    return (size_t)hint;
+}
+
+static VALUE
+write_data2(VALUE arg)
+{
+    struct io_write *iw = (struct io_write *)arg;
     VALUE str, rb_write_len;
     int write_len;
-    struct io_write *iw;
-
-    if (png_ptr == NULL)
-	return;
 
-    str = rb_str_new(data, length);
-    iw = (struct io_write *)png_get_io_ptr(png_ptr);
+    str = rb_str_new((char *)iw->data, iw->length);
     rb_write_len = rb_funcall(iw->io, id_write, 1, str);
     write_len = NUM2INT(rb_write_len);
 
-    if ((size_t)write_len != length)
+    if ((size_t)write_len != iw->length)
 	rb_raise(rb_eRuntimeError, "Write Error. Wrote %d instead of %d bytes.",
-		 write_len, (int)length);
-    iw->total += length;
+		 write_len, (int)iw->length);
+    iw->total += iw->length;
+
+    return Qnil;
+}
+
+/* Writes to a File go straight to its descriptor, without the GVL. */
+
+static void
+write_out(png_structp png_ptr, struct io_write *iw)
+{
+    if (iw->out.fd < 0) {
+	pcallback(png_ptr, write_data2, (VALUE)iw);
+	return;
+    }
+
+    if (axon_fd_write(&iw->out, iw->data, iw->length))
+	png_error(png_ptr, "Write Error.");
+    iw->total += iw->length;
+}
+
+static void
+flush_buffer(png_structp png_ptr, struct io_write *iw)
+{
+    if (!iw->buf_len)
+	return;
+
+    iw->data = iw->buf;
+    iw->length = iw->buf_len;
+    iw->buf_len = 0;
+    write_out(png_ptr, iw);
 }
 
 void
-flush_data(png_structp png_ptr)
+write_data(png_structp png_ptr, png_bytep data, png_size_t length)
 {
-    /* do nothing */
+    struct io_write *iw;
+    size_t n;
+
+    if (png_ptr == NULL)
+	return;
+
+    iw = (struct io_write *)png_get_io_ptr(png_ptr);
+
+    /* Large writes skip the buffer when it is empty. */
+    if (!iw->buf_len && length >= iw->bufsize) {
+	iw->data = data;
+	iw->length = length;
+	write_out(png_ptr, iw);
+	return;
+    }
+
+    while (length) {
+	n = iw->bufsize - iw->buf_len;
+	if (n > length)
+	    n = length;
+
+	memcpy(iw->buf + iw->buf_len, data, n);
+	iw->buf_len += n;
+	data += n;
+	length -= n;
+
+	if (iw->buf_len == iw->bufsize)
+	    flush_buffer(png_ptr, iw);
+    }
 }
 
+/*
+ * PNG.encode appends libpng's output straight to the String it returns. We
+ * only need the GVL when the String has to grow.
+ */
+
 static VALUE
-write_scanline(VALUE scan_line, png_structp png_ptr, png_infop info_ptr)
+grow_string(VALUE arg)
+{
+    struct io_write *iw = (struct io_write *)arg;
+
+    axon_str_reserve(iw->io, iw->total + iw->length);
+    return Qnil;
+}
+
+static void
+write_string_data(png_structp png_ptr, png_bytep data, png_size_t length)
 {
-    png_uint_32 width;
-    png_byte components;
+    struct io_write *iw;
+
+    if (png_ptr == NULL)
+	return;
 
-    if (TYPE(scan_line) != T_STRING)
-	scan_line = rb_obj_as_string(scan_line);
+    iw = (struct io_write *)png_get_io_ptr(png_ptr);
 
-    width = png_get_image_width(png_ptr, info_ptr);
-    components = png_get_channels(png_ptr, info_ptr);
-    if ((png_uint_32)RSTRING_LEN(scan_line) != width * components)
-	rb_raise(rb_eRuntimeError, "Scanline has a bad size. Expected %d * %d but got %d.",
-		 (int)width, (int)components, (int)RSTRING_LEN(scan_line));
+    if (iw->total + length > (size_t)RSTRING_LEN(iw->io)) {
+	iw->length = length;
+	pcallback(png_ptr, grow_string, (VALUE)iw);
+    }
 
-    png_write_row(png_ptr, (png_bytep)RSTRING_PTR(scan_line));
-    return Qnil;
+    memcpy(RSTRING_PTR(iw->io) + iw->total, data, length);
+    iw->total += length;
+}
+
+void
+flush_data(png_structp png_ptr)
+{
+    /* do nothing, we flush once the image is done */
 }
 
 static void
@@ -130,25 +432,534 @@ write_configure(VALUE image_in, png_structp png_ptr, png_infop info_ptr)
 		 PNG_FILTER_TYPE_DEFAULT);
 }
 
+static int
+id_to_filter(ID rb)
+{
+    if      (rb == id_none)     return PNG_FILTER_NONE;
+    else if (rb == id_sub)      return PNG_FILTER_SUB;
+    else if (rb == id_up)       return PNG_FILTER_UP;
+    else if (rb == id_avg)      return PNG_FILTER_AVG;
+    else if (rb == id_paeth)    return PNG_FILTER_PAETH;
+    else if (rb == id_adaptive) return PNG_ALL_FILTERS;
+
+    rb_raise(rb_eRuntimeError, "Filter not recognized.");
+}
+
+static int
+id_to_strategy(ID rb)
+{
+    if      (rb == id_default)      return Z_DEFAULT_STRATEGY;
+    else if (rb == id_filtered)     return Z_FILTERED;
+    else if (rb == id_huffman_only) return Z_HUFFMAN_ONLY;
+#ifdef Z_RLE
+    else if (rb == id_rle)          return Z_RLE;
+#endif
+#ifdef Z_FIXED
+    else if (rb == id_fixed)        return Z_FIXED;
+#endif
+
+    rb_raise(rb_eRuntimeError, "Compression strategy not recognized.");
+}
+
+/* Encoder settings from the PNG.write options. */
+struct png_settings {
+    int level, strategy, filter;	/* -1 leaves the libpng default */
+    size_t threads;
+};
+
+/*
+ * Reads the :preset, :compression, :strategy, :filter and :threads options.
+ * Explicit options win over the preset.
+ */
+
+static void
+parse_options(struct png_settings *settings, VALUE options)
+{
+    VALUE preset, compression, strategy, filter, threads;
+    int level;
+
+    settings->level = settings->strategy = settings->filter = -1;
+    settings->threads = 1;
+
+    if (NIL_P(options) || TYPE(options) != T_HASH)
+	return;
+
+    preset = rb_hash_aref(options, sym_preset);
+    compression = rb_hash_aref(options, sym_compression);
+    strategy = rb_hash_aref(options, sym_strategy);
+    filter = rb_hash_aref(options, sym_filter);
+    threads = rb_hash_aref(options, sym_threads);
+
+    if (!NIL_P(preset)) {
+	if (SYM2ID(preset) == id_fast) {
+	    settings->level = 1;
+	    settings->filter = PNG_FILTER_SUB;
+	} else if (SYM2ID(preset) == id_small) {
+	    settings->level = 9;
+	    settings->filter = PNG_ALL_FILTERS;
+	} else {
+	    rb_raise(rb_eRuntimeError, "Preset not recognized.");
+	}
+    }
+
+    if (!NIL_P(compression)) {
+	level = NUM2INT(compression);
+	if (level < 0 || level > 9)
+	    rb_raise(rb_eRuntimeError, "Compression level must be in 0..9");
+	settings->level = level;
+    }
+
+    if (!NIL_P(strategy))
+	settings->strategy = id_to_strategy(SYM2ID(strategy));
+
+    if (!NIL_P(filter))
+	settings->filter = id_to_filter(SYM2ID(filter));
+
+    if (!NIL_P(threads)) {
+	if (NUM2INT(threads) < 1)
+	    rb_raise(rb_eRuntimeError, "Thread count must be greater than zero");
+	settings->threads = (size_t)NUM2INT(threads);
+    }
+}
+
+static void
+apply_settings(png_structp png_ptr, struct png_settings *settings)
+{
+    if (settings->level >= 0)
+	png_set_compression_level(png_ptr, settings->level);
+
+    if (settings->strategy >= 0)
+	png_set_compression_strategy(png_ptr, settings->strategy);
+
+    if (settings->filter >= 0)
+	png_set_filter(png_ptr, PNG_FILTER_TYPE_BASE, settings->filter);
+}
+
+/*
+ * Parallel encoding
+ *
+ * With :threads we filter and deflate the image ourselves, the way pigz does.
+ * Rows are read in batches of one band per thread. The bands of a batch are
+ * filtered in parallel, then deflated in parallel as raw deflate streams. Each
+ * stream is primed with the 32K of filtered data in front of it and ends on a
+ * sync flush, so the streams join up into one zlib stream. The last band
+ * finishes the stream, and we write it with a zlib header and the combined
+ * adler32 as IDAT chunks.
+ */
+
+#define BAND_SIZE (128 * 1024)
+#define WINDOW_SIZE 32768
+
+struct band {
+    png_bytep rows, prior;	/* raw rows, and the row above the first */
+    size_t num_rows;
+    png_bytep filtered;		/* a filter type byte and a row, per row */
+    png_bytep scratch;		/* two rows for trying out filters */
+    png_bytep dict;		/* filtered data in front of this band */
+    size_t dict_len;
+    png_bytep out;
+    size_t out_len, out_alloc;
+    uLong adler;
+    int last, failed;
+};
+
+struct png_parallel {
+    struct png_settings *settings;
+    size_t rowbytes, bpp, band_rows, num_bands;
+    struct band *bands;
+    png_bytep prior;		/* last row of the previous batch */
+    png_bytep tail;		/* end of the previous batch's filtered data */
+    size_t tail_len;
+};
+
+static void
+parallel_init(struct png_parallel *p)
+{
+    memset(p, 0, sizeof(*p));
+}
+
+static void
+parallel_free(struct png_parallel *p)
+{
+    size_t i;
+
+    if (p->bands)
+	for (i = 0; i < p->num_bands; i++) {
+	    free(p->bands[i].filtered);
+	    free(p->bands[i].scratch);
+	    free(p->bands[i].out);
+	}
+
+    free(p->bands);
+    free(p->prior);
+    free(p->tail);
+}
+
+static void
+parallel_alloc(struct png_parallel *p, struct png_settings *settings,
+	       size_t rowbytes, size_t bpp)
+{
+    size_t i, filtered_len;
+
+    p->settings = settings;
+    p->rowbytes = rowbytes;
+    p->bpp = bpp;
+    p->band_rows = (BAND_SIZE + rowbytes) / (rowbytes + 1);
+    p->num_bands = settings->threads;
+
+    filtered_len = p->band_rows * (rowbytes + 1);
+
+    p->prior = calloc(rowbytes, 1);
+    p->tail = malloc(WINDOW_SIZE);
+    p->bands = calloc(p->num_bands, sizeof(struct band));
+    if (!p->prior || !p->tail || !p->bands)
+	rb_raise(rb_eNoMemError, "unable to allocate encoder buffers");
+
+    for (i = 0; i < p->num_bands; i++) {
+	p->bands[i].filtered = malloc(filtered_len);
+	p->bands[i].scratch = malloc(2 * (rowbytes + 1));
+	if (!p->bands[i].filtered || !p->bands[i].scratch)
+	    rb_raise(rb_eNoMemError, "unable to allocate encoder buffers");
+    }
+}
+
+static png_byte
+paeth(png_byte a, png_byte b, png_byte c)
+{
+    int p, pa, pb, pc;
+
+    p = b - c;
+    pc = a - c;
+    pa = abs(p);
+    pb = abs(pc);
+    pc = abs(p + pc);
+
+    if (pa <= pb && pa <= pc)
+	return a;
+
+    return pb <= pc ? b : c;
+}
+
+/*
+ * Filters +row+ into +out+ with PNG filter +type+, and returns the sum of the
+ * filtered bytes taken as signed values, which is what libpng minimizes when
+ * it picks a filter.
+ */
+
+static size_t
+filter_row(png_bytep out, png_bytep row, png_bytep prior, size_t rowbytes,
+	   size_t bpp, int type)
+{
+    size_t i, sum = 0;
+
+    out[0] = (png_byte)type;
+    out++;
+
+    switch (type) {
+      case PNG_FILTER_VALUE_NONE:
+	memcpy(out, row, rowbytes);
+	break;
+      case PNG_FILTER_VALUE_SUB:
+	memcpy(out, row, bpp);
+	for (i = bpp; i < rowbytes; i++)
+	    out[i] = row[i] - row[i - bpp];
+	break;
+      case PNG_FILTER_VALUE_UP:
+	for (i = 0; i < rowbytes; i++)
+	    out[i] = row[i] - prior[i];
+	break;
+      case PNG_FILTER_VALUE_AVG:
+	for (i = 0; i < bpp; i++)
+	    out[i] = row[i] - prior[i] / 2;
+	for (; i < rowbytes; i++)
+	    out[i] = row[i] - (row[i - bpp] + prior[i]) / 2;
+	break;
+      default:
+	for (i = 0; i < bpp; i++)
+	    out[i] = row[i] - prior[i];
+	for (; i < rowbytes; i++)
+	    out[i] = row[i] - paeth(row[i - bpp], prior[i], prior[i - bpp]);
+    }
+
+    for (i = 0; i < rowbytes; i++)
+	sum += out[i] < 128 ? out[i] : 256 - out[i];
+
+    return sum;
+}
+
+static void
+filter_band(void *arg, size_t job)
+{
+    static const int masks[] = { PNG_FILTER_NONE, PNG_FILTER_SUB,
+				 PNG_FILTER_UP, PNG_FILTER_AVG,
+				 PNG_FILTER_PAETH };
+    struct png_parallel *p = (struct png_parallel *)arg;
+    struct band *b = &p->bands[job];
+    size_t i, sum, best_sum, rowbytes = p->rowbytes;
+    png_bytep row, prior, out, try_row, best, tmp;
+    int type, filter;
+
+    filter = p->settings->filter < 0 ? PNG_ALL_FILTERS : p->settings->filter;
+    prior = b->prior;
+
+    for (i = 0; i < b->num_rows; i++) {
+	row = b->rows + i * rowbytes;
+	out = b->filtered + i * (rowbytes + 1);
+	try_row = b->scratch;
+	best = b->scratch + rowbytes + 1;
+	best_sum = (size_t)-1;
+
+	for (type = 0; type < 5; type++) {
+	    if (!(filter & masks[type]))
+		continue;
+
+	    sum = filter_row(try_row, row, prior, rowbytes, p->bpp, type);
+	    if (sum < best_sum) {
+		best_sum = sum;
+		tmp = best;
+		best = try_row;
+		try_row = tmp;
+	    }
+	}
+
+	memcpy(out, best, rowbytes + 1);
+	prior = row;
+    }
+}
+
+static void
+deflate_band(void *arg, size_t job)
+{
+    struct png_parallel *p = (struct png_parallel *)arg;
+    struct band *b = &p->bands[job];
+    struct png_settings *settings = p->settings;
+    size_t len = b->num_rows * (p->rowbytes + 1), need;
+    int level, strategy, flush, ret;
+    png_bytep out;
+    z_stream z;
+
+    b->adler = adler32(adler32(0L, Z_NULL, 0), b->filtered, (uInt)len);
+
+    level = settings->level < 0 ? Z_DEFAULT_COMPRESSION : settings->level;
+    strategy = settings->strategy;
+    if (strategy < 0)
+	strategy = settings->filter == PNG_FILTER_NONE ? Z_DEFAULT_STRATEGY :
+							 Z_FILTERED;
+
+    memset(&z, 0, sizeof(z));
+    if (deflateInit2(&z, level, Z_DEFLATED, -15, 8, strategy) != Z_OK) {
+	b->failed = 1;
+	return;
+    }
+
+    if (b->dict_len)
+	deflateSetDictionary(&z, b->dict, (uInt)b->dict_len);
+
+    /* room for the worst case, plus the sync flush marker */
+    need = deflateBound(&z, len) + 16;
+    flush = b->last ? Z_FINISH : Z_SYNC_FLUSH;
+    z.next_in = b->filtered;
+    z.avail_in = (uInt)len;
+
+    for (;;) {
+	if (b->out_alloc < need) {
+	    out = realloc(b->out, need);
+	    if (!out) {
+		b->failed = 1;
+		break;
+	    }
+	    b->out = out;
+	    b->out_alloc = need;
+	}
+
+	z.next_out = b->out + z.total_out;
+	z.avail_out = (uInt)(b->out_alloc - z.total_out);
+
+	ret = deflate(&z, flush);
+	if (ret == Z_STREAM_ERROR) {
+	    b->failed = 1;
+	    break;
+	}
+
+	if (b->last ? ret == Z_STREAM_END : z.avail_out > 0)
+	    break;
+
+	need = b->out_alloc * 2;
+    }
+
+    b->out_len = z.total_out;
+    deflateEnd(&z);
+}
+
+static void
+write_idat(png_structp png_ptr, png_bytep head, size_t head_len,
+	   png_bytep data, size_t len, png_bytep tail, size_t tail_len)
+{
+    png_write_chunk_start(png_ptr, (png_bytep)"IDAT",
+			  (png_uint_32)(head_len + len + tail_len));
+    if (head_len)
+	png_write_chunk_data(png_ptr, head, head_len);
+    png_write_chunk_data(png_ptr, data, len);
+    if (tail_len)
+	png_write_chunk_data(png_ptr, tail, tail_len);
+    png_write_chunk_end(png_ptr);
+}
+
+static void
+write_parallel(png_structp png_ptr, png_infop info_ptr,
+	       struct axon_pipeline *pipeline, struct png_parallel *p)
+{
+    png_byte header[2], trailer[4];
+    png_bytep batch;
+    size_t i, y, n, height, batch_rows, num_bands, dict_len;
+    struct band *b;
+    uLong adler;
+    int level, flevel;
+
+    height = png_get_image_height(png_ptr, info_ptr);
+
+    /* zlib header for a 32K window, with the level hint zlib would use */
+    level = p->settings->level < 0 ? 6 : p->settings->level;
+    flevel = level < 2 ? 0 : level < 6 ? 1 : level == 6 ? 2 : 3;
+    header[0] = 0x78;
+    header[1] = (png_byte)(flevel << 6);
+    header[1] += 31 - ((header[0] << 8) + header[1]) % 31;
+
+    adler = adler32(0L, Z_NULL, 0);
+
+    for (y = 0; y < height; y += batch_rows) {
+	batch_rows = height - y;
+	if (batch_rows > p->band_rows * p->num_bands)
+	    batch_rows = p->band_rows * p->num_bands;
+
+	batch = axon_pipeline_read_strip(pipeline, batch_rows);
+	num_bands = (batch_rows + p->band_rows - 1) / p->band_rows;
+
+	for (i = 0; i < num_bands; i++) {
+	    b = &p->bands[i];
+	    b->rows = batch + i * p->band_rows * p->rowbytes;
+	    b->prior = i ? b->rows - p->rowbytes : p->prior;
+	    b->num_rows = i < num_bands - 1 ? p->band_rows :
+					      batch_rows - i * p->band_rows;
+	    b->last = y + batch_rows == height && i == num_bands - 1;
+	}
+
+	axon_parallel(filter_band, p, num_bands, p->settings->threads);
+
+	for (i = 0; i < num_bands; i++) {
+	    b = &p->bands[i];
+	    if (i) {
+		n = p->bands[i - 1].num_rows * (p->rowbytes + 1);
+		dict_len = n < WINDOW_SIZE ? n : WINDOW_SIZE;
+		b->dict = p->bands[i - 1].filtered + n - dict_len;
+		b->dict_len = dict_len;
+	    } else {
+		b->dict = p->tail;
+		b->dict_len = p->tail_len;
+	    }
+	}
+
+	axon_parallel(deflate_band, p, num_bands, p->settings->threads);
+
+	for (i = 0; i < num_bands; i++)
+	    if (p->bands[i].failed)
+		rb_raise(rb_eRuntimeError, "zlib: unable to deflate the image");
+
+	for (i = 0; i < num_bands; i++) {
+	    b = &p->bands[i];
+	    n = b->num_rows * (p->rowbytes + 1);
+	    adler = adler32_combine(adler, b->adler, (z_off_t)n);
+
+	    if (b->last) {
+		trailer[0] = (png_byte)(adler >> 24);
+		trailer[1] = (png_byte)(adler >> 16);
+		trailer[2] = (png_byte)(adler >> 8);
+		trailer[3] = (png_byte)adler;
+	    }
+
+	    write_idat(png_ptr, y == 0 && i == 0 ? header : NULL,
+		       y == 0 && i == 0 ? 2 : 0, b->out, b->out_len,
+		       trailer, b->last ? 4 : 0);
+	}
+
+	/* carry the row above and the deflate window into the next batch */
+	b = &p->bands[num_bands - 1];
+	n = b->num_rows * (p->rowbytes + 1);
+	p->tail_len = n < WINDOW_SIZE ? n : WINDOW_SIZE;
+	memcpy(p->tail, b->filtered + n - p->tail_len, p->tail_len);
+	memcpy(p->prior, batch + (batch_rows - 1) * p->rowbytes, p->rowbytes);
+    }
+
+    png_write_chunk(png_ptr, (png_bytep)"IEND", NULL, 0);
+}
+
 static VALUE
 write_png2(VALUE *args)
 {
     struct io_write *data;
     png_structp png_ptr = (png_structp)args[0];
     png_infop info_ptr = (png_infop)args[1];
-    VALUE scanline, image_in = args[2];
-    size_t i;
+    VALUE image_in = args[2];
+    struct axon_pipeline *pipeline = (struct axon_pipeline *)args[3];
+    struct png_settings *settings = (struct png_settings *)args[4];
+    struct png_parallel *parallel = (struct png_parallel *)args[5];
+    size_t i, n, height, rowbytes, channels;
+
+    if (setjmp(png_jmpbuf(png_ptr)))
+	raise_perr((struct perr *)png_get_error_ptr(png_ptr));
 
     write_configure(image_in, png_ptr, info_ptr);
+    apply_settings(png_ptr, settings);
+
+    channels = png_get_channels(png_ptr, info_ptr);
+    rowbytes = png_get_image_width(png_ptr, info_ptr) * channels;
+
+    /* Without a size hint, start the String at half the raw image size. */
+    data = (struct io_write *)png_get_io_ptr(png_ptr);
+    if (data->string && !RSTRING_LEN(data->io))
+	axon_str_reserve(data->io, rowbytes * png_get_image_height(png_ptr,
+				   info_ptr) / 2 + WRITE_BUFSIZE);
+
+    if (settings->threads > 1) {
+	parallel_alloc(parallel, settings, rowbytes, channels);
+	axon_pipeline_build(pipeline, image_in, rowbytes,
+			    parallel->band_rows * parallel->num_bands);
+	png_write_info(png_ptr, info_ptr);
+	write_parallel(png_ptr, info_ptr, pipeline, parallel);
+	goto flush;
+    }
+
+    axon_pipeline_build(pipeline, image_in, rowbytes, AXON_STRIP_ROWS);
     png_write_info(png_ptr, info_ptr);
 
-    for (i = 0; i < png_get_image_height(png_ptr, info_ptr); i++) {
-	scanline = rb_funcall(image_in, id_gets, 0);
-	write_scanline(scanline, png_ptr, info_ptr);
+    height = png_get_image_height(png_ptr, info_ptr);
+
+    /* From here on libpng is only called through pcall(). */
+    for (i = 0; i < height; i += n) {
+	n = height - i;
+	if (n > AXON_STRIP_ROWS)
+	    n = AXON_STRIP_ROWS;
+
+	pcall(png_ptr, info_ptr, do_write_rows,
+	      (png_bytep)axon_pipeline_read_strip(pipeline, n), n);
     }
-    png_write_end(png_ptr, info_ptr);
+
+    pcall(png_ptr, info_ptr, do_write_end, NULL, 0);
+
+flush:
 
     data = (struct io_write *)png_get_io_ptr(png_ptr);
+    if (data->buf_len && data->out.fd >= 0) {
+	if (axon_fd_write_nogvl(&data->out, data->buf, data->buf_len))
+	    rb_sys_fail("write");
+	data->total += data->buf_len;
+	data->buf_len = 0;
+    } else if (data->buf_len) {
+	data->data = data->buf;
+	data->length = data->buf_len;
+	data->buf_len = 0;
+	write_data2((VALUE)data);
+    }
 
     return INT2FIX(data->total);
 }
@@ -158,173 +969,678 @@ write_png2_ensure(VALUE *args)
 {
     png_structp png_ptr = (png_structp)args[0];
     png_infop info_ptr = (png_infop)args[1];
+    struct io_write *data = (struct io_write *)png_get_io_ptr(png_ptr);
 
+    free(data->buf);
+    axon_fd_close(&data->out);
     png_destroy_write_struct(&png_ptr, &info_ptr);
+    axon_pipeline_free((struct axon_pipeline *)args[3]);
+    parallel_free((struct png_parallel *)args[5]);
     return Qnil;
 }
 
+/*
+ * Writes +image_in+ through +data+, which must have its buffer set up. The
+ * buffer is freed when we are done.
+ */
+
+static VALUE
+write_png_to(VALUE image_in, struct io_write *data, png_rw_ptr write_fn,
+	     struct png_settings *settings)
+{
+    VALUE ensure_args[6];
+    png_structp png_ptr;
+    png_infop info_ptr;
+    struct axon_pipeline pipeline;
+    struct png_parallel parallel;
+    struct perr err;
+
+    init_perr(&err);
+    png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, (png_voidp)&err,
+				      (png_error_ptr)png_error_fn,
+				      (png_error_ptr)png_warning_fn);
+
+    if (png_ptr == NULL) {
+	free(data->buf);
+	rb_raise(rb_eRuntimeError, "unable to allocate a png object");
+    }
+
+    info_ptr = png_create_info_struct(png_ptr);
+    if (info_ptr == NULL) {
+	free(data->buf);
+	png_destroy_write_struct(&png_ptr, (png_info **)NULL);
+	rb_raise(rb_eRuntimeError, "unable to allocate a png info object");
+    }
+
+    png_set_write_fn(png_ptr, (void *)data, write_fn, flush_data);
+
+    ensure_args[0] = (VALUE)png_ptr;
+    ensure_args[1] = (VALUE)info_ptr;
+    ensure_args[2] = image_in;
+    ensure_args[3] = (VALUE)&pipeline;
+    ensure_args[4] = (VALUE)settings;
+    ensure_args[5] = (VALUE)&parallel;
+
+    axon_pipeline_init(&pipeline);
+    parallel_init(&parallel);
+
+    return rb_ensure(write_png2, (VALUE)ensure_args, write_png2_ensure,
+                     (VALUE)ensure_args);
+}
+
+/* Sets up +data+ to write to +io_out+ in +bufsize+ chunks. */
+
+static void
+init_io_write(struct io_write *data, VALUE io_out, size_t bufsize,
+	      size_t size_hint)
+{
+    if (axon_fd_open(&data->out, io_out, size_hint) &&
+	bufsize < AXON_FD_BUFSIZE)
+	bufsize = AXON_FD_BUFSIZE;
+
+    data->io = io_out;
+    data->total = 0;
+    data->bufsize = bufsize;
+    data->buf_len = 0;
+    data->string = 0;
+    data->buf = malloc(bufsize);
+    if (data->buf == NULL)
+	rb_raise(rb_eNoMemError, "unable to allocate a write buffer");
+}
+
+/* Sets up +data+ to append to +str+, see PNG.encode. */
+
+static void
+init_string_write(struct io_write *data, VALUE str)
+{
+    data->io = str;
+    data->total = 0;
+    data->bufsize = 0;
+    data->buf_len = 0;
+    data->string = 1;
+    data->out.fd = -1;
+    data->buf = NULL;
+}
+
 /*
  *  call-seq:
- *     write(image_in, io_out) -> integer
+ *     write(image_in, io_out [, options]) -> integer
  *
  *  Writes the given image +image_in+ to +io_out+ as compressed PNG data.
  *  Returns the number of bytes written.
  *
+ *  +options+ may contain the following symbols:
+ *
+ *     * :bufsize - the size in bytes of the writes that will be made to
+ *        +io_out+. Smaller libpng writes are collected until they fill the
+ *        buffer.
+ *     * :size_hint - the expected size of the image in bytes. When +io_out+
+ *        is a File, this much space is preallocated for it and whatever is
+ *        left over is trimmed at the end.
+ *     * :compression - the zlib compression level, 0..9. 0 stores the image
+ *        uncompressed, 9 is the smallest and slowest.
+ *     * :strategy - the zlib strategy, one of :default, :filtered,
+ *        :huffman_only, :rle or :fixed.
+ *     * :filter - the row filter, one of :none, :sub, :up, :avg, :paeth or
+ *        :adaptive. :adaptive tries every filter on each row.
+ *     * :preset - :fast (level 1 with the sub filter) for transient images,
+ *        or :small (level 9 with adaptive filtering) for images that are
+ *        kept around. Any of the options above override the preset.
+ *     * :threads - the number of threads to filter and deflate the image
+ *        with. The image is compressed in 128K bands that are joined into a
+ *        single zlib stream, which costs a little compression.
+ *
+ *  A File opened write-only in binary mode is written straight to its file
+ *  descriptor in large blocks, without calling write or holding the GVL.
+ *
  *     image = Axon::Solid.new(200, 300)
  *     io = File.open("test.jpg", "w")
  *     Axon::PNG.write(image, io)     #=> 1234
  */
 
 static VALUE
-write_png(VALUE self, VALUE image_in, VALUE io_out)
+write_png(int argc, VALUE *argv, VALUE self)
+{
+    VALUE image_in, io_out, options;
+    struct io_write data;
+    struct png_settings settings;
+    size_t bufsize;
+
+    rb_scan_args(argc, argv, "21", &image_in, &io_out, &options);
+    bufsize = bufsize_option(options, WRITE_BUFSIZE);
+    parse_options(&settings, options);
+
+    init_io_write(&data, io_out, bufsize, size_hint_option(options));
+    return write_png_to(image_in, &data, write_data, &settings);
+}
+
+/*
+ *  call-seq:
+ *     encode(image_in [, options]) -> string
+ *
+ *  Compresses +image_in+ and returns the PNG data as a binary String. This
+ *  takes the same +options+ as PNG.write, except for :bufsize, plus:
+ *
+ *     * :size_hint - the number of bytes to allocate up front. The String
+ *        doubles in size whenever it fills up, and is trimmed at the end.
+ *        By default it starts at half the raw image size.
+ *
+ *  libpng's output is appended to the String directly, without going
+ *  through an IO.
+ *
+ *     png = Axon::PNG.encode(image, :preset => :fast)
+ */
+
+static VALUE
+encode_png(int argc, VALUE *argv, VALUE self)
+{
+    VALUE image_in, options, str;
+    struct io_write data;
+    struct png_settings settings;
+
+    rb_scan_args(argc, argv, "11", &image_in, &options);
+    parse_options(&settings, options);
+
+    str = rb_str_new(0, size_hint_option(options));
+    init_string_write(&data, str);
+    write_png_to(image_in, &data, write_string_data, &settings);
+    rb_str_resize(str, data.total);
+
+    return str;
+}
+
+/*
+ * libpng has no way to reset a write struct for another image, so an Encoder
+ * creates one per image like PNG.write. What it saves is parsing the options.
+ */
+
+struct png_encoder {
+    struct png_settings settings;
+    size_t bufsize, size_hint;
+};
+
+static VALUE
+encoder_allocate(VALUE klass)
+{
+    struct png_encoder *enc;
+    VALUE self;
+
+    self = Data_Make_Struct(klass, struct png_encoder, 0, free, enc);
+    parse_options(&enc->settings, Qnil);
+    enc->bufsize = WRITE_BUFSIZE;
+
+    return self;
+}
+
+/*
+ *  call-seq:
+ *     Encoder.new([options]) -> encoder
+ *
+ *  Creates a PNG Encoder that compresses any number of images with the same
+ *  +options+, which are those of PNG.write and PNG.encode. It has the same
+ *  interface as JPEG::Encoder, but libpng is still set up for every image.
+ *
+ *     encoder = Axon::PNG::Encoder.new(:preset => :fast)
+ *     thumbs = images.map { |image| encoder.encode(image) }
+ */
+
+static VALUE
+encoder_initialize(int argc, VALUE *argv, VALUE self)
+{
+    struct png_encoder *enc;
+    VALUE options;
+
+    Data_Get_Struct(self, struct png_encoder, enc);
+    rb_scan_args(argc, argv, "01", &options);
+
+    parse_options(&enc->settings, options);
+    enc->bufsize = bufsize_option(options, WRITE_BUFSIZE);
+    enc->size_hint = size_hint_option(options);
+
+    return self;
+}
+
+/*
+ *  call-seq:
+ *     encoder.write(image_in, io_out) -> integer
+ *
+ *  Writes +image_in+ to +io_out+ as compressed PNG data, like PNG.write.
+ *  Returns the number of bytes written.
+ */
+
+static VALUE
+encoder_write(VALUE self, VALUE image_in, VALUE io_out)
+{
+    struct png_encoder *enc;
+    struct io_write data;
+
+    Data_Get_Struct(self, struct png_encoder, enc);
+    init_io_write(&data, io_out, enc->bufsize, enc->size_hint);
+    return write_png_to(image_in, &data, write_data, &enc->settings);
+}
+
+/*
+ *  call-seq:
+ *     encoder.encode(image_in) -> string
+ *
+ *  Compresses +image_in+ and returns the PNG data as a binary String, like
+ *  PNG.encode.
+ */
+
+static VALUE
+encoder_encode(VALUE self, VALUE image_in)
+{
+    struct png_encoder *enc;
+    struct io_write data;
+    VALUE str;
+
+    Data_Get_Struct(self, struct png_encoder, enc);
+
+    str = rb_str_new(0, enc->size_hint);
+    init_string_write(&data, str);
+    write_png_to(image_in, &data, write_string_data, &enc->settings);
+    rb_str_resize(str, data.total);
+
+    return str;
+}
+
+static void
+raise_if_locked(struct png_data *reader)
+{
+    if (reader->err.nogvl)
+	rb_raise(rb_eRuntimeError, "pnglib: already in use by another thread.");
+
+    if (reader->lineno)
+	rb_raise(rb_eRuntimeError, "Can't modify a locked Reader");
+}
+
+static void
+free_reader(struct png_data *reader)
+{
+    png_structp png_ptr;
+    png_infop info_ptr;
+
+    png_ptr = reader->png_ptr;
+    info_ptr = reader->info_ptr;
+
+    if (png_ptr && info_ptr)
+	png_destroy_read_struct(&png_ptr, &info_ptr, (png_info **)NULL);
+    else if (png_ptr)
+	png_destroy_read_struct(&png_ptr, (png_info **)NULL, (png_info **)NULL);
+
+    free(reader->buf);
+    if (reader->push) {
+	free(reader->push->rows.buf);
+	free(reader->push);
+    }
+    free(reader);
+}
+
+static VALUE
+fill_buffer(VALUE arg)
+{
+    struct png_data *reader = (struct png_data *)arg;
+    VALUE str;
+    size_t read_len;
+
+    str = rb_funcall(reader->io, id_read, 1, SIZET2NUM(reader->bufsize));
+
+    if (NIL_P(str))
+	rb_raise(rb_eRuntimeError, "Read Error. Reader returned nil.");
+
+    StringValue(str);
+    read_len = RSTRING_LEN(str);
+
+    if (read_len == 0)
+	rb_raise(rb_eRuntimeError, "Read Error. Reader returned no data.");
+
+    if (read_len > reader->bufsize)
+	rb_raise(rb_eRuntimeError, "Read Error. Read %d instead of %d bytes.",
+		 (int)read_len, (int)reader->bufsize);
+
+    memcpy(reader->buf, RSTRING_PTR(str), read_len);
+    reader->buf_pos = 0;
+    reader->buf_len = read_len;
+
+    return Qnil;
+}
+
+/*
+ * Serves libpng's reads, which are often just a few bytes for chunk headers
+ * and CRCs, out of a buffer that is refilled with one io.read at a time.
+ */
+
+void
+read_data_fn(png_structp png_ptr, png_bytep data, png_size_t length)
+{
+    struct png_data *reader;
+    size_t n;
+
+    if (png_ptr == NULL)
+	return;
+
+    reader = (struct png_data *)png_get_io_ptr(png_ptr);
+
+    while (length) {
+	if (reader->buf_pos == reader->buf_len)
+	    pcallback(png_ptr, fill_buffer, (VALUE)reader);
+
+	n = reader->buf_len - reader->buf_pos;
+	if (n > length)
+	    n = length;
+
+	memcpy(data, reader->buf + reader->buf_pos, n);
+	reader->buf_pos += n;
+	data += n;
+	length -= n;
+    }
+}
+
+/*
+ * Reads from an Axon::MappedFile or a String. No Ruby objects are involved, so
+ * we don't need to take the GVL back.
+ */
+
+static void
+read_file_fn(png_structp png_ptr, png_bytep data, png_size_t length)
+{
+    struct axon_file *file;
+    const unsigned char *src;
+    ssize_t n;
+
+    file = (struct axon_file *)png_get_io_ptr(png_ptr);
+
+    while (length) {
+	n = axon_file_read(file, &src, length);
+
+	if (n < 0)
+	    png_error(png_ptr, "Read Error.");
+	if (n == 0)
+	    png_error(png_ptr, "Read Error. Unexpected end of file.");
+
+	memcpy(data, src, (size_t)n);
+	data += n;
+	length -= (size_t)n;
+    }
+}
+
+static void
+mark(struct png_data *reader)
+{
+    VALUE io = reader->io;
+
+    if (io)
+	rb_gc_mark(io);
+}
+
+static void
+create_read_struct(struct png_data *reader)
 {
-    VALUE ensure_args[3];
     png_structp png_ptr;
     png_infop info_ptr;
-    struct io_write data;
 
-    png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, (png_voidp)NULL,
-				      (png_error_ptr)png_error_fn,
-				      (png_error_ptr)png_warning_fn);
+    init_perr(&reader->err);
+    png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING,
+				     (png_voidp)&reader->err,
+				     (png_error_ptr)png_error_fn,
+				     (png_error_ptr)png_warning_fn);
+
+    if (png_ptr == NULL)
+	rb_raise(rb_eRuntimeError, "unable to allocate a png object");
+
+    info_ptr = png_create_info_struct(png_ptr);
+    if (info_ptr == NULL) {
+	png_destroy_read_struct(&png_ptr, (png_info **)NULL, (png_info **)NULL);
+	rb_raise(rb_eRuntimeError, "unable to allocate a png info object");
+    }
+
+    reader->png_ptr = png_ptr;
+    reader->info_ptr = info_ptr;
+}
+
+static VALUE
+allocate(VALUE klass)
+{
+    VALUE self;
+    struct png_data *reader;
+
+    self = Data_Make_Struct(klass, struct png_data, mark, free_reader, reader);
+    create_read_struct(reader);
+
+    return self;
+}
+
+/*
+ * A Reader created with a nil io_in is fed with reader << data, which hands
+ * the data to libpng's progressive reader. It calls these back as the header
+ * and rows are decoded.
+ */
+
+static void
+push_info(png_structp png_ptr, png_infop info_ptr)
+{
+    struct png_data *reader;
+    struct png_push *p;
+    size_t height;
+
+    reader = (struct png_data *)png_get_progressive_ptr(png_ptr);
+    p = reader->push;
 
-    if (png_ptr == NULL)
-	rb_raise(rb_eRuntimeError, "unable to allocate a png object");
+    if (png_get_color_type(png_ptr, info_ptr) == PNG_COLOR_TYPE_PALETTE)
+	png_set_palette_to_rgb(png_ptr);
 
-    info_ptr = png_create_info_struct(png_ptr);
-    if (info_ptr == NULL) {
-	png_destroy_write_struct(&png_ptr, (png_info **)NULL);
-	rb_raise(rb_eRuntimeError, "unable to allocate a png info object");
+    if (png_get_interlace_type(png_ptr, info_ptr) != PNG_INTERLACE_NONE) {
+	png_set_interlace_handling(png_ptr);
+	p->interlaced = 1;
     }
 
-    data.io = io_out;
-    data.total = 0;
-    png_set_write_fn(png_ptr, (void *)&data, write_data, flush_data);
+    png_read_update_info(png_ptr, info_ptr);
+    p->rows.row_len = png_get_rowbytes(png_ptr, info_ptr);
 
-    ensure_args[0] = (VALUE)png_ptr;
-    ensure_args[1] = (VALUE)info_ptr;
-    ensure_args[2] = image_in;
+    /* Interlaced rows are built up over several passes in a full image. */
+    height = png_get_image_height(png_ptr, info_ptr);
+    if (p->interlaced && !axon_rows_reserve(&p->rows, height))
+	png_error(png_ptr, "Unable to allocate the image.");
 
-    return rb_ensure(write_png2, (VALUE)ensure_args, write_png2_ensure,
-                     (VALUE)ensure_args);
+    p->header = 1;
 }
 
 static void
-raise_if_locked(struct png_data *reader)
+push_row(png_structp png_ptr, png_bytep new_row, png_uint_32 row_num,
+	 int pass)
 {
-    if (reader->lineno)
-	rb_raise(rb_eRuntimeError, "Can't modify a locked Reader");
-}
+    struct png_data *reader;
+    struct png_push *p;
+    png_bytep dest;
 
-static void
-free_reader(struct png_data *reader)
-{
-    png_structp png_ptr;
-    png_infop info_ptr;
+    reader = (struct png_data *)png_get_progressive_ptr(png_ptr);
+    p = reader->push;
 
-    png_ptr = reader->png_ptr;
-    info_ptr = reader->info_ptr;
+    if (p->interlaced) {
+	dest = p->rows.buf + (size_t)row_num * p->rows.row_len;
+	png_progressive_combine_row(png_ptr, dest, new_row);
 
-    if (png_ptr && info_ptr)
-	png_destroy_read_struct(&png_ptr, &info_ptr, (png_info **)NULL);
-    else if (png_ptr)
-	png_destroy_read_struct(&png_ptr, (png_info **)NULL, (png_info **)NULL);
+	/* Rows are final once the last pass gets to them. */
+	if (pass == 6)
+	    p->rows.count = row_num + 1 - p->rows.start;
+	return;
+    }
 
-    free(reader);
-}
+    if (!new_row)
+	return;
 
-void
-read_data_fn(png_structp png_ptr, png_bytep data, png_size_t length)
-{
-    VALUE io, str;
-    size_t read_len;
+    dest = axon_rows_reserve(&p->rows, 1);
+    if (!dest)
+	png_error(png_ptr, "Unable to allocate a row.");
 
-    if (png_ptr == NULL)
-	return;
+    memcpy(dest, new_row, p->rows.row_len);
+    p->rows.count++;
+}
 
-    io = (VALUE)png_get_io_ptr(png_ptr);
-    str = rb_funcall(io, id_read, 1, INT2FIX(length));
+static void
+push_end(png_structp png_ptr, png_infop info_ptr)
+{
+    struct png_data *reader;
+    struct png_push *p;
 
-    if (NIL_P(str))
-	rb_raise(rb_eRuntimeError, "Read Error. Reader returned nil.");
+    reader = (struct png_data *)png_get_progressive_ptr(png_ptr);
+    p = reader->push;
 
-    StringValue(str);
-    read_len = RSTRING_LEN(str);
+    if (p->interlaced)
+	p->rows.count = png_get_image_height(png_ptr, info_ptr) - p->rows.start;
+}
 
-    if (read_len != length)
-	rb_raise(rb_eRuntimeError, "Read Error. Read %d instead of %d bytes.",
-		 (int)read_len, (int)length);
+static void
+push_init(struct png_data *reader)
+{
+    if (!reader->push) {
+	reader->push = calloc(1, sizeof(struct png_push));
+	if (!reader->push)
+	    rb_raise(rb_eNoMemError, "unable to allocate decoder buffers");
+    }
 
-    memcpy(data, RSTRING_PTR(str), length);
+    reader->io = Qnil;
+    png_set_progressive_read_fn(reader->png_ptr, (void *)reader, push_info,
+				push_row, push_end);
 }
 
+/* Reads the header of the PNG image in +io+, which must not be nil. */
+
 static void
-mark(struct png_data *reader)
+read_info(struct png_data *reader, VALUE io, size_t bufsize)
 {
-    VALUE io = reader->io;
+    png_structp png_ptr = reader->png_ptr;
+    png_infop info_ptr = reader->info_ptr;
+    struct axon_file *file;
+
+    if (bufsize != reader->bufsize) {
+	free(reader->buf);
+	reader->buf = malloc(bufsize);
+	reader->bufsize = reader->buf ? bufsize : 0;
+	if (!reader->buf)
+	    rb_raise(rb_eNoMemError, "unable to allocate a read buffer");
+    }
+    reader->buf_pos = reader->buf_len = 0;
+
+    if (TYPE(io) == T_STRING) {
+	io = rb_str_new_frozen(io);
+	axon_file_string(&reader->mem, io);
+	file = &reader->mem;
+    } else {
+	file = axon_file_get(io);
+    }
 
-    if (io)
-	rb_gc_mark(io);
+    if (file)
+	png_set_read_fn(png_ptr, (void *)file, read_file_fn);
+    else
+	png_set_read_fn(png_ptr, (void *)reader, read_data_fn);
+
+    reader->io = io;
+
+    if (setjmp(png_jmpbuf(png_ptr)))
+	raise_perr(&reader->err);
+
+    png_read_info(png_ptr, info_ptr);
+    
+    if (png_get_color_type(png_ptr, info_ptr) == PNG_COLOR_TYPE_PALETTE) {
+	png_set_palette_to_rgb(png_ptr);
+	png_read_update_info(png_ptr, info_ptr);
+    }
 }
 
+/*
+ *  call-seq:
+ *     Reader.new(io_in [, options]) -> reader
+ *
+ *  Creates a new PNG Reader. +io_in+ must be an IO-like object that responds
+ *  to read(size), or a String of PNG data. Strings and Axon::MappedFile are
+ *  decoded in place, without calling read(size).
+ *
+ *  +options+ may contain the following symbols:
+ *
+ *     * :bufsize - the size in bytes of the reads that will be made from
+ *        +io_in+.
+ *
+ *     io = File.open("image.png", "r")
+ *     reader = Axon::PNG::Reader.new(io)
+ *
+ *  When +io_in+ is nil the reader is fed with reader << data instead, see
+ *  #<<.
+ */
+
 static VALUE
-allocate(VALUE klass)
+initialize(int argc, VALUE *argv, VALUE self)
 {
-    VALUE self;
     struct png_data *reader;
-    png_structp png_ptr;
-    png_infop info_ptr;
-    
-    self = Data_Make_Struct(klass, struct png_data, mark, free_reader, reader);
-    png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, (png_voidp)NULL,
-				     (png_error_ptr)png_error_fn,
-				     (png_error_ptr)png_warning_fn);
+    VALUE io, options;
+    size_t bufsize;
 
-    if (png_ptr == NULL)
-	rb_raise(rb_eRuntimeError, "unable to allocate a png object");
+    Data_Get_Struct(self, struct png_data, reader);
+    raise_if_locked(reader);
 
-    info_ptr = png_create_info_struct(png_ptr);
-    if (info_ptr == NULL) {
-	png_destroy_read_struct(&png_ptr, (png_info **)NULL, (png_info **)NULL);
-	rb_raise(rb_eRuntimeError, "unable to allocate a png info object");
+    rb_scan_args(argc, argv, "11", &io, &options);
+    bufsize = bufsize_option(options, READ_BUFSIZE);
+
+    if (NIL_P(io)) {
+	push_init(reader);
+	return self;
     }
 
-    reader->png_ptr = png_ptr;
-    reader->info_ptr = info_ptr;
+    read_info(reader, io, bufsize);
 
     return self;
 }
 
 /*
  *  call-seq:
- *     Reader.new(io_in) -> reader
+ *     Decoder.new -> decoder
  *
- *  Creates a new PNG Reader. +io_in+ must be an IO-like object that responds
- *  to read(size).
+ *  Creates a PNG Decoder, a Reader that decodes one image after another.
+ *  Call #decode with each image and read it like any other Reader. It has
+ *  the same interface as JPEG::Decoder and keeps its read buffer, but libpng
+ *  is still set up for every image.
+ */
+
+static VALUE
+decoder_initialize(VALUE self)
+{
+    return self;
+}
+
+/*
+ *  call-seq:
+ *     decoder.decode(io_in [, options]) -> decoder
  *
- *     io = File.open("image.png", "r")
- *     reader = Axon::PNG::Reader.new(io)
+ *  Starts decoding the image in +io_in+, dropping whatever is left of the
+ *  previous one. +io_in+ and +options+ are as for Reader.new, except that
+ *  +io_in+ can't be nil. The header is read right away.
  */
 
 static VALUE
-initialize(VALUE self, VALUE io)
+decode(int argc, VALUE *argv, VALUE self)
 {
     struct png_data *reader;
-    png_structp png_ptr;
-    png_infop info_ptr;
+    VALUE io, options;
+    size_t bufsize;
 
     Data_Get_Struct(self, struct png_data, reader);
-    png_ptr = reader->png_ptr;
-    info_ptr = reader->info_ptr;
+    rb_scan_args(argc, argv, "11", &io, &options);
 
-    raise_if_locked(reader);
-    png_set_read_fn(png_ptr, (void *)io, read_data_fn);
-    reader->io = io;
-    png_read_info(png_ptr, info_ptr);
-    
-    if (png_get_color_type(png_ptr, info_ptr) == PNG_COLOR_TYPE_PALETTE) {
-	png_set_palette_to_rgb(png_ptr);
-	png_read_update_info(png_ptr, info_ptr);
-    }
+    if (reader->err.nogvl)
+	rb_raise(rb_eRuntimeError, "pnglib: already in use by another thread.");
+
+    if (NIL_P(io))
+	rb_raise(rb_eTypeError, "A Decoder can't be fed with <<.");
+
+    bufsize = bufsize_option(options, READ_BUFSIZE);
+
+    png_destroy_read_struct(&reader->png_ptr, &reader->info_ptr,
+			    (png_info **)NULL);
+    reader->io = Qnil;
+    reader->lineno = 0;
+
+    create_read_struct(reader);
+    read_info(reader, io, bufsize);
 
     return self;
 }
@@ -382,43 +1698,261 @@ color_model(VALUE self)
 
 /*
  *  call-seq:
- *     gets -> string or nil
+ *     reader << data -> reader
+ *
+ *  Feeds the next chunk of the image to a reader that was created with a nil
+ *  +io_in+. Chunks can be any size.
+ *
+ *  #width, #height and the other header fields are available once the header
+ *  has arrived. Rows are decoded as data arrives. Rows of interlaced images
+ *  only become available as the last pass reaches them. Asking for more
+ *  scanlines than #rows_available raises an error until the rest of the
+ *  image is pushed.
+ *
+ *     reader = Axon::PNG::Reader.new(nil)
+ *     socket.each_chunk do |chunk|
+ *       reader << chunk
+ *       reader.rows_available.times { out << reader.gets }
+ *     end
+ */
+
+static VALUE
+push(VALUE self, VALUE data)
+{
+    struct png_data *reader;
+
+    Data_Get_Struct(self, struct png_data, reader);
+
+    if (!reader->push)
+	rb_raise(rb_eRuntimeError, "Reader was not created with a nil io_in.");
+
+    /* A frozen copy can't change while libpng reads it without the GVL. */
+    data = rb_str_new_frozen(StringValue(data));
+    pcall(reader->png_ptr, reader->info_ptr, do_process_data,
+	  (png_bytep)RSTRING_PTR(data), RSTRING_LEN(data));
+    RB_GC_GUARD(data);
+
+    return self;
+}
+
+/*
+ *  call-seq:
+ *     reader.rows_available -> number
+ *
+ *  Returns the number of scanlines that can be read from a reader fed with
+ *  #<< before it needs more data.
+ */
+
+static VALUE
+rows_available(VALUE self)
+{
+    struct png_data *reader;
+
+    Data_Get_Struct(self, struct png_data, reader);
+
+    if (!reader->push)
+	rb_raise(rb_eRuntimeError, "Reader was not created with a nil io_in.");
+
+    return SIZET2NUM(reader->push->rows.count);
+}
+
+/* Raises if a reader fed with << hasn't been given the whole header. */
+
+static void
+need_header(struct png_data *reader)
+{
+    if (reader->push && !reader->push->header)
+	rb_raise(rb_eRuntimeError, "Reader needs more data.");
+}
+
+static size_t
+push_read_rows(struct png_data *reader, png_bytep dest, size_t n)
+{
+    struct png_push *p = reader->push;
+
+    if (p->rows.count < n)
+	rb_raise(rb_eRuntimeError, "Reader needs more data.");
+
+    axon_rows_shift(&p->rows, dest, n);
+    reader->lineno += n;
+
+    return n;
+}
+
+/*
+ * Reads up to +n+ rows into +dest+, packed one after another. Returns the
+ * number of rows read, which is only less than +n+ at the end of the image.
+ */
+
+static size_t
+read_rows(struct png_data *reader, png_bytep dest, size_t n)
+{
+    png_structp png_ptr = reader->png_ptr;
+    png_infop info_ptr = reader->info_ptr;
+    size_t height;
+
+    height = png_get_image_height(png_ptr, info_ptr);
+    if (reader->lineno >= height)
+	return 0;
+
+    if (n > height - reader->lineno)
+	n = height - reader->lineno;
+
+    if (reader->push)
+	return push_read_rows(reader, dest, n);
+
+    pcall(png_ptr, info_ptr, do_read_rows, dest, n);
+    reader->lineno += n;
+
+    if (reader->lineno >= height)
+	pcall(png_ptr, info_ptr, do_read_end, NULL, 0);
+
+    return n;
+}
+
+/*
+ *  call-seq:
+ *     gets([buffer]) -> string or nil
  *
  *  Reads the next scanline of data from the image.
  *
+ *  If a +buffer+ string is given, the scanline is read into it and +buffer+
+ *  is returned. Reusing a buffer avoids allocating a new string per scanline.
+ *
  *  If the end of the image has been reached, this will return nil.
  */
 
+/*
+ * Reads one scanline into args[1]. libpng may write to it without the GVL, so
+ * the caller keeps the String locked, the way IO#read does with a buffer.
+ */
+
 static VALUE
-p_gets(VALUE self)
+gets_locked(VALUE arg)
+{
+    VALUE *args = (VALUE *)arg;
+    struct png_data *reader = (struct png_data *)args[0];
+
+    read_rows(reader, (png_bytep)RSTRING_PTR(args[1]), 1);
+    return Qnil;
+}
+
+static VALUE
+p_gets(int argc, VALUE *argv, VALUE self)
 {
     struct png_data *reader;
-    png_structp png_ptr;
-    png_infop info_ptr;
     png_uint_32 sl_width;
-    size_t height;
+    VALUE sl, buffer, args[2];
+
+    rb_scan_args(argc, argv, "01", &buffer);
+
+    Data_Get_Struct(self, struct png_data, reader);
+    need_header(reader);
+
+    if (reader->lineno >= png_get_image_height(reader->png_ptr,
+					       reader->info_ptr))
+	return Qnil;
+
+    sl_width = png_get_rowbytes(reader->png_ptr, reader->info_ptr);
+    sl = axon_buffer(buffer, sl_width);
+
+    args[0] = (VALUE)reader;
+    args[1] = sl;
+    rb_str_locktmp(sl);
+    rb_ensure(gets_locked, (VALUE)args, rb_str_unlocktmp, sl);
+
+    return sl;
+}
+
+/*
+ *  call-seq:
+ *     gets_rows(n) -> string or nil
+ *
+ *  Reads the next +n+ scanlines from the image and returns them packed into
+ *  a single string. Fewer than +n+ scanlines are returned at the end of the
+ *  image, and nil once there are none left.
+ */
+
+static VALUE
+p_gets_rows(VALUE self, VALUE rows)
+{
+    struct png_data *reader;
+    png_uint_32 sl_width, height;
     VALUE sl;
+    long n;
+    size_t ret;
+
+    n = NUM2LONG(rows);
+    if (n < 1)
+	rb_raise(rb_eArgError, "Number of rows must be at least 1.");
 
     Data_Get_Struct(self, struct png_data, reader);
-    png_ptr = reader->png_ptr;
-    info_ptr = reader->info_ptr;
+    need_header(reader);
 
-    height = png_get_image_height(png_ptr, info_ptr);
+    height = png_get_image_height(reader->png_ptr, reader->info_ptr);
     if (reader->lineno >= height)
 	return Qnil;
 
-    sl_width = png_get_rowbytes(png_ptr, info_ptr);
+    if ((size_t)n > height - reader->lineno)
+	n = height - reader->lineno;
 
-    sl = rb_str_new(0, sl_width);
-    png_read_row(png_ptr, (png_bytep)RSTRING_PTR(sl), (png_bytep)NULL);
-    reader->lineno += 1;
+    sl_width = png_get_rowbytes(reader->png_ptr, reader->info_ptr);
+    sl = rb_str_new(0, sl_width * n);
+    ret = read_rows(reader, (png_bytep)RSTRING_PTR(sl), n);
+    RB_GC_GUARD(sl);
 
-    if (reader->lineno >= height)
-	png_read_end(png_ptr, info_ptr);
+    if (ret < (size_t)n)
+	rb_str_set_len(sl, sl_width * ret);
 
     return sl;
 }
 
+static void
+source_read_row(struct axon_source *src, unsigned char *row)
+{
+    struct png_data *reader = (struct png_data *)src->data;
+
+    if (!read_rows(reader, (png_bytep)row, 1))
+	rb_raise(rb_eRuntimeError, "pnglib: Reader ran out of scanlines.");
+    src->lineno = reader->lineno;
+}
+
+static void
+source_read_strip(struct axon_source *src, unsigned char *strip, size_t n)
+{
+    struct png_data *reader = (struct png_data *)src->data;
+
+    if (read_rows(reader, (png_bytep)strip, n) < n)
+	rb_raise(rb_eRuntimeError, "pnglib: Reader ran out of scanlines.");
+    src->lineno = reader->lineno;
+}
+
+/*
+ * Hooks a PNG::Reader into a native pipeline. Returns 0 if +obj+ is not a
+ * PNG::Reader.
+ */
+
+int
+axon_png_source(struct axon_source *src, VALUE obj)
+{
+    struct png_data *reader;
+
+    if (rb_obj_class(obj) != cPNGReader && rb_obj_class(obj) != cPNGDecoder)
+	return 0;
+
+    Data_Get_Struct(obj, struct png_data, reader);
+
+    src->read_row = source_read_row;
+    src->read_strip = source_read_strip;
+    src->data = reader;
+    src->width = png_get_image_width(reader->png_ptr, reader->info_ptr);
+    src->height = png_get_image_height(reader->png_ptr, reader->info_ptr);
+    src->components = png_get_channels(reader->png_ptr, reader->info_ptr);
+    src->lineno = reader->lineno;
+
+    return 1;
+}
+
 /*
  *  call-seq:
  *     reader.width -> number
@@ -483,25 +2017,51 @@ lineno(VALUE self)
  * Read compressed PNG images from an IO.
  */
 
+/*
+ * Document-class: Axon::PNG::Decoder
+ *
+ * Read one compressed PNG image after another.
+ */
+
+/*
+ * Document-class: Axon::PNG::Encoder
+ *
+ * Compress one PNG image after another with the same options.
+ */
+
 void
 Init_PNG()
 {
-    VALUE mAxon, mPNG, cPNGReader;
+    VALUE mAxon, mPNG, cPNGEncoder;
 
     mAxon = rb_define_module("Axon");
     mPNG = rb_define_module_under(mAxon, "PNG");
     rb_const_set(mPNG, rb_intern("LIB_VERSION"), INT2FIX(PNG_LIBPNG_VER));
-    rb_define_singleton_method(mPNG, "write", write_png, 2);
+    rb_define_singleton_method(mPNG, "write", write_png, -1);
+    rb_define_singleton_method(mPNG, "encode", encode_png, -1);
 
     cPNGReader = rb_define_class_under(mPNG, "Reader", rb_cObject);
     rb_define_alloc_func(cPNGReader, allocate);
-    rb_define_method(cPNGReader, "initialize", initialize, 1);
+    rb_define_method(cPNGReader, "initialize", initialize, -1);
     rb_define_method(cPNGReader, "color_model", color_model, 0);
     rb_define_method(cPNGReader, "components", components, 0);
     rb_define_method(cPNGReader, "width", width, 0);
     rb_define_method(cPNGReader, "height", height, 0);
-    rb_define_method(cPNGReader, "gets", p_gets, 0);
+    rb_define_method(cPNGReader, "gets", p_gets, -1);
+    rb_define_method(cPNGReader, "gets_rows", p_gets_rows, 1);
     rb_define_method(cPNGReader, "lineno", lineno, 0);
+    rb_define_method(cPNGReader, "<<", push, 1);
+    rb_define_method(cPNGReader, "rows_available", rows_available, 0);
+
+    cPNGDecoder = rb_define_class_under(mPNG, "Decoder", cPNGReader);
+    rb_define_method(cPNGDecoder, "initialize", decoder_initialize, 0);
+    rb_define_method(cPNGDecoder, "decode", decode, -1);
+
+    cPNGEncoder = rb_define_class_under(mPNG, "Encoder", rb_cObject);
+    rb_define_alloc_func(cPNGEncoder, encoder_allocate);
+    rb_define_method(cPNGEncoder, "initialize", encoder_initialize, -1);
+    rb_define_method(cPNGEncoder, "write", encoder_write, 2);
+    rb_define_method(cPNGEncoder, "encode", encoder_encode, 1);
 
     id_GRAYSCALE = rb_intern("GRAYSCALE");
     id_RGB = rb_intern("RGB");
@@ -509,6 +2069,26 @@ Init_PNG()
     id_RGB = rb_intern("RGB_ALPHA");
     id_write = rb_intern("write");
     id_read = rb_intern("read");
+    sym_bufsize = ID2SYM(rb_intern("bufsize"));
+    sym_compression = ID2SYM(rb_intern("compression"));
+    sym_strategy = ID2SYM(rb_intern("strategy"));
+    sym_filter = ID2SYM(rb_intern("filter"));
+    sym_preset = ID2SYM(rb_intern("preset"));
+    sym_threads = ID2SYM(rb_intern("threads"));
+    sym_size_hint = ID2SYM(rb_intern("size_hint"));
+    id_none = rb_intern("none");
+    id_sub = rb_intern("sub");
+    id_up = rb_intern("up");
+    id_avg = rb_intern("avg");
+    id_paeth = rb_intern("paeth");
+    id_adaptive = rb_intern("adaptive");
+    id_default = rb_intern("default");
+    id_filtered = rb_intern("filtered");
+    id_huffman_only = rb_intern("huffman_only");
+    id_rle = rb_intern("rle");
+    id_fixed = rb_intern("fixed");
+    id_fast = rb_intern("fast");
+    id_small = rb_intern("small");
     id_gets = rb_intern("gets");
     id_width = rb_intern("width");
     id_height = rb_intern("height");
@@ -6,11 +6,54 @@ require 'axon/fit'
 require 'axon/scalers'
 require 'axon/generators'
 require 'axon/alpha_stripper'
+require 'axon/tee'
+require 'axon/batch'
+require 'axon/probe'
 require 'stringio'
 
 module Axon
   VERSION = '0.2.0'
 
+  # Remembers which image classes accept a buffer argument to #gets.
+  BUFFERED_GETS = Hash.new do |h, klass| # :nodoc:
+    h[klass] = begin
+      klass.instance_method(:gets).arity != 0
+    rescue NameError
+      false
+    end
+  end
+
+  # Reads the next scanline from +image+. If +image+ can read into a
+  # caller-supplied +buffer+, the scanline is read into +buffer+ instead of a
+  # new string.
+  def self.gets_into(image, buffer) # :nodoc:
+    if buffer && BUFFERED_GETS[image.class]
+      image.gets(buffer)
+    else
+      image.gets
+    end
+  end
+
+  # Returns something a decoder can read +thing+ from. The C readers decode
+  # Strings in place, elsewhere we wrap them in a StringIO.
+  def self.source(thing) # :nodoc:
+    return thing if thing.respond_to?(:read)
+    return thing if String === thing && defined?(MappedFile)
+    StringIO.new(thing)
+  end
+
+  # Opens +path+ for reading by a decoder. Where the extension provides
+  # MappedFile the decoders read the file natively, otherwise we fall back to a
+  # plain File.
+  def self.open_file(path) # :nodoc:
+    f = defined?(MappedFile) ? MappedFile.new(path) : File.open(path, 'rb')
+    begin
+      yield f
+    ensure
+      f.close
+    end
+  end
+
   # :call-seq:
   #   Axon.jpeg(thing [, markers]) -> image
   #
@@ -35,8 +78,7 @@ module Axon
   #   image_3 = Axon.jpeg(io_in, [:APP2]) # Only reads the APP2 marker
   #
   def self.jpeg(thing, *args)
-    thing = StringIO.new(thing) unless thing.respond_to?(:read)
-    reader = JPEG::Reader.new(thing, *args)
+    reader = JPEG::Reader.new(source(thing), *args)
     Image.new(reader)
   end
 
@@ -60,26 +102,27 @@ module Axon
   #   end
   #
   def self.jpeg_file(path, *args)
-    File.open(path, 'rb') do |f|
+    open_file(path) do |f|
       yield jpeg(f, *args)
     end
   end
 
   # :call-seq:
-  #   Axon.png(thing) -> image
+  #   Axon.png(thing [, options]) -> image
   #
   # Reads a compressed PNG image from +thing+. +thing+ can be an IO object,
   # the path to a PNG image, or binary PNG data.
   #
+  # +options+ are passed on to PNG::Reader.new.
+  #
   #   io_in = File.open("image.png", "r")
   #   image = Axon.png(io_in)         # Read PNG from a StringIO
   #
   #   png_data = IO.read("image.png")
   #   image_2 = Axon.png(png_data)    # Read PNG from image data
   #
-  def self.png(thing)
-    thing = StringIO.new(thing) unless thing.respond_to?(:read)
-    reader = PNG::Reader.new(thing)
+  def self.png(thing, *args)
+    reader = PNG::Reader.new(source(thing), *args)
     Image.new(reader)
   end
 
@@ -95,7 +138,7 @@ module Axon
   #   end
   #
   def self.png_file(path, *args)
-    File.open(path, 'rb') do |f|
+    open_file(path) do |f|
       yield png(f, *args)
     end
   end
@@ -169,6 +212,27 @@ module Axon
       self
     end
 
+    # :call-seq:
+    #   scale_area(width, height)
+    #
+    # Shrinks the image by averaging the pixels that fall into each pixel of
+    # the resulting image.
+    #
+    # This is slower than bilinear interpolation, but every source pixel is
+    # used, so it gives much smoother results when shrinking by large ratios.
+    #
+    # == Example
+    #
+    #   i = Axon::JPEG('test.jpg')
+    #   i.scale_area(50, 75)
+    #   i.width  # => 50
+    #   i.height # => 75
+    #
+    def scale_area(*args)
+      @source = AreaScaler.new(@source, *args)
+      self
+    end
+
     # :call-seq:
     #   fit(width, height)
     #
@@ -223,23 +287,40 @@ module Axon
     #
     # +options+ may contain the following symbols:
     #
+    # * :background  -- flatten an alpha channel onto this color rather than
+    #   dropping it. See AlphaStripper.
     # * :bufsize     -- the maximum size in bytes of the writes that will be
     #   made to +io_out+
     # * :quality     -- JPEG quality on a 0..100 scale.
     # * :exif        -- Raw exif string that will be saved in the header.
     # * :icc_profile -- Raw ICC profile string that will be saved in the header.
     #
+    # The encoder options :threads, :optimize_coding, :progressive,
+    # :subsampling, :dct_method, :smoothing and :profile are passed on to
+    # JPEG.write.
+    #
     # == Example
     #
     #   i = Axon::JPEG('input.jpg')
     #   io_out = File.open('output.jpg', 'w')
     #   i.jpeg(io_out, :quality => 88) # writes the image to output.jpg
     #
-    def jpeg(*args)
-      case @source.components
-      when 2,4 then @source = AlphaStripper.new(@source)
-      end
-      JPEG.write(@source, *args)
+    def jpeg(io_out, options=nil)
+      options ||= {}
+      strip_alpha(options)
+      JPEG.write(@source, io_out, options)
+    end
+
+    # :call-seq:
+    #   jpeg_data([options]) -> string
+    #
+    # Returns the image as a String of compressed JPEG data, see JPEG.encode.
+    # Takes the same +options+ as Axon#jpeg, plus :size_hint.
+    #
+    def jpeg_data(options=nil)
+      options ||= {}
+      strip_alpha(options)
+      JPEG.encode(@source, options)
     end
 
     # :call-seq:
@@ -280,6 +361,15 @@ module Axon
       PNG.write(@source, *args)
     end
 
+    # :call-seq:
+    #   png_data([options]) -> string
+    #
+    # Returns the image as a String of compressed PNG data, see PNG.encode.
+    #
+    def png_data(*args)
+      PNG.encode(@source, *args)
+    end
+
     # :call-seq:
     #   png_file(path)
     #
@@ -298,6 +388,64 @@ module Axon
       end
     end
 
+    # :call-seq:
+    #   renditions(jobs) -> results
+    #
+    # Writes several versions of the image while reading it only once, and
+    # returns an array with the result of each job.
+    #
+    # Each job is a Hash with :operations, :output, :format and :options keys,
+    # as described in Axon.batch. Every job is written on its own thread from
+    # an Axon::Tee of the image, so memory use is bounded by the scalers' row
+    # windows rather than by the size of the image.
+    #
+    # This saves decoding the image once per job, but the image is still
+    # decoded on one thread at a time as the jobs take turns reading from the
+    # Tee. Each job's operations and encoding run in parallel with the others.
+    #
+    # When the image is a JPEG, it is decoded with the smallest DCT scaling
+    # that still serves the largest rendition, as long as each job starts
+    # with :fit or one of the scalers.
+    #
+    # If any job fails, the first error is raised once all jobs are done.
+    #
+    # == Example
+    #
+    #   Axon.jpeg_file("image.jpg") do |image|
+    #     image.renditions([
+    #       { :operations => [[:fit, 1024, 1024]], :output => "large.jpg" },
+    #       { :operations => [[:fit, 256, 256]], :output => "medium.jpg" },
+    #       { :operations => [[:fit, 64, 64]], :format => :png }
+    #     ])  #=> [123456, 23456, "\x89PNG..."]
+    #   end
+    #
+    def renditions(jobs)
+      if defined?(JPEG::Reader) && JPEG::Reader === @source
+        r = renditions_ratio(jobs)
+        Axon.jpeg_scale_dct(@source, r) if r < 1
+      end
+
+      tee = Tee.new(@source)
+      branches = jobs.map { tee.branch }
+
+      threads = jobs.zip(branches).map do |job, branch|
+        Thread.new do
+          begin
+            Axon.batch_write(Image.new(branch), job)
+          rescue StandardError => e
+            e
+          ensure
+            branch.close
+          end
+        end
+      end
+
+      results = threads.map { |t| t.value }
+      error = results.find { |r| r.kind_of?(StandardError) }
+      raise error if error
+      results
+    end
+
     # Gets the components in the image.
     #
     def components
@@ -322,14 +470,44 @@ module Axon
       @source.lineno
     end
 
-    # Gets the next scanline from the image.
+    # :call-seq:
+    #   gets([buffer]) -> string or nil
     #
-    def gets
-      @source.gets
+    # Gets the next scanline from the image. If a +buffer+ string is given and
+    # the underlying image supports it, the scanline is read into +buffer+.
+    #
+    def gets(buffer=nil)
+      Axon.gets_into(@source, buffer)
     end
     
     def method_missing(name, *args)
       @source.send(name, *args)
     end
+
+    private
+
+    def strip_alpha(options)
+      case @source.components
+      when 2,4
+        @source = AlphaStripper.new(@source, :background => options[:background])
+      end
+    end
+
+    # The largest fraction of the image's size that any job needs.
+    def renditions_ratio(jobs)
+      ratios = jobs.map do |job|
+        name, w, h = (job[:operations] || []).first
+        case name
+        when :fit
+          [w / width.to_f, h / height.to_f].min
+        when :scale_bilinear, :scale_nearest, :scale_area
+          [w / width.to_f, h / height.to_f].max
+        else
+          1
+        end
+      end
+
+      ratios.max || 1
+    end
   end
 end
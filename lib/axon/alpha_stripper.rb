@@ -4,18 +4,33 @@ module Axon
   #
   # Axon::AlphaStripper Removes the Alpha Channel from an Image.
   #
+  # The alpha channel can either be dropped, or the image can be flattened onto
+  # a solid background color.
+  #
   # == Example
   #
+  #   image_in = Axon::Solid.new(100, 200, "\x0A\x14\x69\x80")
+  #   a = Axon::AlphaStripper.new(image_in, :background => "\xFF\xFF\xFF")
+  #   a.components # => 3
   #
   class AlphaStripper
 
     # :call-seq:
-    #   AlphaStripper.new(image_in)
+    #   AlphaStripper.new(image_in, options = {})
     #
     # Removes the alpha channel from +image_in+.
     #
-    def initialize(source)
+    # +options+ may contain the following optional hash key values:
+    #
+    # * :background -- A color with one value per color channel of
+    #   +image_in+, for example "\xFF\xFF\xFF" for an RGBA image. Each pixel
+    #   is composited onto this color instead of just having its alpha value
+    #   discarded.
+    #
+    def initialize(source, options=nil)
+      options ||= {}
       @source = source
+      @background = options[:background]
     end
 
     # Gets the height of the image. Same as the height of the source image.
@@ -46,24 +61,18 @@ module Axon
       @source.lineno
     end
 
-    # Gets the next scanline from the image.
+    # :call-seq:
+    #   gets([buffer]) -> string or nil
     #
-    def gets
-      sl = @source.gets
-      return unless sl
+    # Gets the next scanline from the image, optionally reading it into
+    # +buffer+.
+    #
+    def gets(buffer=nil)
+      cmp = @source.components
+      return Axon.gets_into(@source, buffer) unless cmp == 2 || cmp == 4
 
-      # This should probably be done in C, but not seeing alpha stripping
-      # performance as terribly important right now.
-      case @source.components
-      when 2
-        (sl.size / 2).times{ |i| sl.slice!(1) }
-        sl
-      when 4
-        (sl.size / 4).times{ |i| sl.slice!(3) }
-        sl
-      else
-        sl
-      end
+      return unless @buf = Axon.gets_into(@source, @buf)
+      Interpolation.strip_alpha(@buf, cmp, @background, buffer)
     end
   end
 end
@@ -0,0 +1,102 @@
+require 'thread'
+
+module Axon
+  # The operations a batch job may list, see Axon.batch.
+  BATCH_OPERATIONS = [:crop, :fit, :scale_bilinear, :scale_nearest,
+                      :scale_area] # :nodoc:
+
+  # Batch jobs hand the writers large buffers, so they rarely need the GVL.
+  BATCH_BUFSIZE = 64 * 1024 # :nodoc:
+
+  # :call-seq:
+  #   Axon.batch(jobs [, options]) -> results
+  #
+  # Runs many independent read, transform and write jobs on a pool of
+  # threads, and returns an array with the result of each job in the same
+  # order as +jobs+.
+  #
+  # Every job is a Hash with the following keys:
+  #
+  # * :input      -- the path to a JPEG or PNG image, or a String of JPEG or
+  #   PNG data. The format is detected from the data.
+  # * :operations -- an array of operations to apply in order, each an array
+  #   of an Image method name and its arguments. The methods are :crop, :fit,
+  #   :scale_bilinear, :scale_nearest and :scale_area.
+  # * :output     -- the path to write the result to. When not given the
+  #   result is returned as a String.
+  # * :format     -- :jpeg or :png. Defaults to :png when :output ends in
+  #   .png, otherwise :jpeg.
+  # * :options    -- options for JPEG.write or PNG.write, such as :quality.
+  #
+  # A job's result is the number of bytes written to :output, or the String of
+  # image data. If a job raises an error the error is its result, and the other
+  # jobs carry on.
+  #
+  # +options+ may contain the following symbols:
+  #
+  # * :threads -- how many jobs to run at once, 1 by default.
+  #
+  # Each job has its own readers, scalers and writers. Decoding, encoding and
+  # the operations above run without the GVL, which is only taken back to hand
+  # each strip of decoded rows to the operations, so jobs proceed in parallel.
+  #
+  #   Axon.batch([
+  #     { :input => "a.jpg", :operations => [[:fit, 100, 100]],
+  #       :output => "a_thumb.jpg", :options => { :quality => 80 } },
+  #     { :input => IO.read("b.png"), :operations => [[:crop, 50, 50]] }
+  #   ], :threads => 4)   #=> [1234, "\xFF\xD8..."]
+  #
+  def self.batch(jobs, options=nil)
+    threads = (options && options[:threads]) || 1
+    raise ArgumentError, "Thread count must be greater than zero" if threads < 1
+
+    results = Array.new(jobs.size)
+    lock = Mutex.new
+    next_job = 0
+
+    workers = Array.new([threads, jobs.size].min) do
+      Thread.new do
+        loop do
+          i = lock.synchronize { next_job += 1; next_job - 1 }
+          break if i >= jobs.size
+
+          results[i] = begin
+            batch_job(jobs[i])
+          rescue StandardError => e
+            e
+          end
+        end
+      end
+    end
+
+    workers.each { |t| t.join }
+    results
+  end
+
+  def self.batch_job(job) # :nodoc:
+    open(job[:input]) { |image| batch_write(image, job) }
+  end
+
+  def self.batch_write(image, job) # :nodoc:
+    (job[:operations] || []).each do |name, *args|
+      unless BATCH_OPERATIONS.include?(name)
+        raise ArgumentError, "Unknown operation: #{name.inspect}"
+      end
+      image.send(name, *args)
+    end
+
+    output = job[:output]
+    format = job[:format]
+    format ||= output && File.extname(output).downcase == '.png' ? :png : :jpeg
+    options = { :bufsize => BATCH_BUFSIZE }.merge(job[:options] || {})
+
+    case format
+    when :jpeg
+      output ? image.jpeg_file(output, options) : image.jpeg_data(options)
+    when :png
+      output ? image.png_file(output, options) : image.png_data(options)
+    else
+      raise ArgumentError, "Unknown format: #{format.inspect}"
+    end
+  end
+end
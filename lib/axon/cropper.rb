@@ -12,6 +12,11 @@ module Axon
   #   c.height # => 75
   #   c.gets   # => String
   #
+  # == Cropping JPEG Images
+  #
+  # When +image_in+ is a JPEG::Reader that libjpeg can crop, the rows above
+  # the cropped area are skipped and only the columns around it are decoded.
+  #
   # == Example of Cropping Past the Boundaries of the Original Image
   #
   #   image_in = Axon::Solid.new(100, 200)
@@ -19,6 +24,8 @@ module Axon
   #   c.width # => 40
   #
   class Cropper
+    EMPTY = ''.freeze # :nodoc:
+
     # The index of the next line that will be fetched by gets, starting at 0.
     attr_reader :lineno
 
@@ -45,6 +52,8 @@ module Axon
       @x_offset = x_offset
       @y_offset = y_offset
       @lineno = 0
+      @source_x = 0
+      @source_width = nil
     end
 
     # Calculates the height of the cropped image.
@@ -60,8 +69,8 @@ module Axon
     # Calculates the width of the cropped image.
     #
     def width
-      if @x_offset + @width > @source.width
-        [@source.width - @x_offset, 0].max
+      if @x_offset + @width > source_width
+        [source_width - @x_offset, 0].max
       else
         @width
       end
@@ -74,20 +83,53 @@ module Axon
       @source.components
     end
 
-    # Gets the next scanline from the cropped image.
+    # :call-seq:
+    #   gets([buffer]) -> string or nil
     #
-    def gets
+    # Gets the next scanline from the cropped image. If a +buffer+ string is
+    # given, the scanline is read into it and the cropping is done in place.
+    #
+    def gets(buffer=nil)
       return nil if @lineno >= height || width < 1 || height < 1
 
+      push_down if @lineno == 0
+
       while @source.lineno < @y_offset
-        break unless @source.gets
+        break unless Axon.gets_into(@source, buffer)
       end
 
       @lineno += 1
 
       sl_width = width * components
-      sl_offset = @x_offset * components
-      @source.gets[sl_offset, sl_width]
+      sl_offset = (@x_offset - @source_x) * components
+
+      return @source.gets[sl_offset, sl_width] unless buffer
+
+      sl = Axon.gets_into(@source, buffer)
+      return sl[sl_offset, sl_width] unless sl.equal?(buffer)
+
+      buffer[0, sl_offset] = EMPTY if sl_offset > 0
+      buffer[sl_width, buffer.size - sl_width] = EMPTY
+      buffer
+    end
+
+    private
+
+    # The width of +image_in+ before any cropping was pushed into it.
+    def source_width
+      @source_width || @source.width
+    end
+
+    # Asks a JPEG::Reader source to only decode the area we are cropping to.
+    # Its scanlines will then start at column @source_x of the original image.
+    def push_down
+      return if @source_width
+      @source_width = @source.width
+
+      return unless @source.respond_to?(:decode_window)
+      return unless @source.lineno == 0 && width > 0 && height > 0
+
+      @source_x = @source.decode_window(@x_offset, @y_offset, width)
     end
   end
 end
@@ -1,12 +1,48 @@
 require 'axon/scalers'
 
 module Axon
+  # Some versions of libjpeg can perform DCT scaling during the jpeg decoding
+  # phase. This is fast and accurate scaling, so we want to take advantage of
+  # it if at all possible.
+  #
+  # Since this form of scaling only happens in increments, we probably won't
+  # be able to scale to the exact desired size, so our strategy is to scale to
+  # as close to the desired size as possible without scaling too much.
+  #
+  # This depends on our version of libjpeg:
+  #   * libjpeg version 7 and greater can scale N/8 with all N from 1 to 16.
+  #   * libjpeg version 6 and below can scale 1/N with all N from 1 to 8.
+  #   * jruby doesn't do this at all
+  def self.jpeg_scale_dct(reader, r) # :nodoc:
+    return unless defined?(JPEG::LIB_VERSION)
+    if JPEG::LIB_VERSION >= 70
+      # when shrinking, we want scale_num to be the next highest integer
+      if r < 1
+        reader.scale_num = (r * 8).ceil
+      # when growing, we want scale_num to be the next lowest integer
+      else
+        reader.scale_num = (r * 8).to_i
+      end
+    else
+      if r <= 0.5
+        reader.scale_denom = case (1/r).to_i
+        when 2,3     then 2
+        when 4,5,6,7 then 4
+        else              8
+        end
+      end
+    end
+  end
 
   # == An Image Box Scaler
   #
   # Axon::Fit will scale images to fit inside given box dimensions while
   # maintaining the aspect ratio.
   #
+  # Images are enlarged with Axon::NearestNeighborScaler. They are shrunk with
+  # Axon::BilinearScaler, or with Axon::AreaScaler when shrinking to less than
+  # half the size.
+  #
   # == Example
   #
   #   image_in = Axon::Solid.new(10, 20)
@@ -58,15 +94,22 @@ module Axon
       @scaler ? @scaler.lineno : 0
     end
 
-    # Gets the next scanline from the fitted image.
+    # :call-seq:
+    #   gets([buffer]) -> string or nil
     #
-    def gets
-      @scaler ||= get_scaler
-      @scaler.gets
+    # Gets the next scanline from the fitted image, optionally reading it into
+    # +buffer+.
+    #
+    def gets(buffer=nil)
+      Axon.gets_into(scaler, buffer)
     end
 
     private
 
+    def scaler
+      @scaler ||= get_scaler
+    end
+
     def get_scaler
       r = calc_fit_ratio
       return @source if r == 1
@@ -75,13 +118,15 @@ module Axon
       final_height = (r * @source.height).to_i
 
       if @source.kind_of?(JPEG::Reader)
-        jpeg_scale_dct(r)
+        Axon.jpeg_scale_dct(@source, r)
         r = calc_fit_ratio
         return @source if r == 1
       end
 
       if r > 1
         NearestNeighborScaler.new(@source, final_width, final_height)
+      elsif r < 0.5
+        AreaScaler.new(@source, final_width, final_height)
       elsif r < 1
         BilinearScaler.new(@source, final_width, final_height)
       end
@@ -98,38 +143,5 @@ module Axon
         @fit_height / @source.height.to_f
       end
     end
-
-    # Some versions of libjpeg can perform DCT scaling during the jpeg decoding
-    # phase. This is fast and accurate scaling, so we want to take advantage of
-    # it if at all possible.
-    #
-    # Since this form of scaling only happens in increments, we probably won't
-    # be able to scale to the exact desired size, so our strategy is to scale to
-    # as close to the desired size as possible without scaling too much.
-    #
-    # This depends on our version of libjpeg:
-    #   * libjpeg version 7 and greater can scale N/8 with all N from 1 to 16.
-    #   * libjpeg version 6 and below can scale 1/N with all N from 1 to 8.
-    #   * jruby doesn't do this at all
-    def jpeg_scale_dct(r)
-      return unless defined?(JPEG::LIB_VERSION)
-      if JPEG::LIB_VERSION >= 70
-        # when shrinking, we want scale_num to be the next highest integer
-        if r < 1
-          @source.scale_num = (r * 8).ceil
-        # when growing, we want scale_num to be the next lowest integer
-        else
-          @source.scale_num = (r * 8).to_i
-        end
-      else
-        if r <= 0.5
-          @source.scale_denom = case (1/r).to_i
-          when 2,3     then 2
-          when 4,5,6,7 then 4
-          else              8
-          end
-        end
-      end
-    end
   end
 end
\ No newline at end of file
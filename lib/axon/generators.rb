@@ -42,11 +42,15 @@ module Axon
       end
     end
 
-    # Gets the next scanline from the generated image.
+    # :call-seq:
+    #   gets([buffer]) -> string or nil
+    #
+    # Gets the next scanline from the generated image, optionally reading it
+    # into +buffer+.
     #
-    def gets
+    def gets(buffer=nil)
       return nil if @lineno >= @height
-      sl = @empty_string.dup
+      sl = buffer ? buffer.replace(@empty_string) : @empty_string.dup
       (@width * @components).times{ sl << rand(2**8) }
       @lineno += 1
       sl
@@ -89,12 +93,17 @@ module Axon
       @lineno = 0
     end
 
-    # Gets the next scanline from the generated image.
+    # :call-seq:
+    #   gets([buffer]) -> string or nil
+    #
+    # Gets the next scanline from the generated image, optionally reading it
+    # into +buffer+.
     #
-    def gets
+    def gets(buffer=nil)
       return nil if @lineno >= @height
       @lineno += 1
-      @color * width
+      return @color * width unless buffer
+      buffer.replace(@row ||= @color * width)
     end
   end
 end
@@ -0,0 +1,275 @@
+module Axon
+  # The header fields of an image, see Axon.probe.
+  #
+  # * format      -- :jpeg or :png.
+  # * width, height
+  # * components  -- the number of components a reader returns for the image.
+  # * color_model -- how the image is stored. :GRAYSCALE, :RGB, :YCbCr, :CMYK
+  #   or :YCCK for JPEG images, and :GRAYSCALE, :GRAYSCALE_ALPHA, :RGB or
+  #   :RGB_ALPHA for PNG images.
+  # * progressive -- true for progressive JPEGs and interlaced PNGs.
+  # * orientation -- the Exif orientation, 1 when the image doesn't have one.
+  #
+  ImageInfo = Struct.new(:format, :width, :height, :components, :color_model,
+                         :progressive, :orientation)
+
+  class ImageInfo
+    alias_method :interlaced, :progressive
+  end
+
+  # JPEG frame markers that start a progressive scan.
+  PROGRESSIVE_SOF = [0xC2, 0xC6, 0xCA, 0xCE] # :nodoc:
+
+  # PNG color types and the components & color model PNG::Reader gives them.
+  PNG_COLOR_TYPES = {
+    0 => [1, :GRAYSCALE], 2 => [3, :RGB], 3 => [3, :RGB],
+    4 => [2, :GRAYSCALE_ALPHA], 6 => [4, :RGB_ALPHA]
+  } # :nodoc:
+
+  # :call-seq:
+  #   Axon.probe(thing) -> image_info
+  #
+  # Reads the header of the JPEG or PNG image in +thing+ and returns an
+  # ImageInfo describing it. +thing+ can be an IO object, a String of image
+  # data or the path to an image.
+  #
+  # Only the header is read, up to the JPEG frame header or the first PNG
+  # image data, and no decoder is set up. The format is detected from the
+  # data. An IO is left somewhere after the header.
+  #
+  #   info = Axon.probe("image.jpg")
+  #   info.width        #=> 640
+  #   info.color_model  #=> :YCbCr
+  #   info.orientation  #=> 6
+  #
+  def self.probe(thing)
+    return probe_io(StringIO.new(thing)) if image_format(thing)
+    return probe_io(thing) if thing.respond_to?(:read)
+    File.open(thing, 'rb') { |f| probe_io(f) }
+  end
+
+  # :call-seq:
+  #   Axon.open(thing [, *args]) -> image
+  #   Axon.open(thing [, *args]) { |image| ... } -> block_result
+  #
+  # Reads the JPEG or PNG image in +thing+, whichever it turns out to be.
+  # +thing+ can be an IO object, a String of image data or the path to an
+  # image. +args+ are passed on to JPEG::Reader.new or PNG::Reader.new.
+  #
+  # When a block is given the image is yielded to it, a file opened from a
+  # path is closed afterwards, and the result of the block is returned.
+  #
+  #   Axon.open("upload") do |image|
+  #     image.fit(100, 100).jpeg_file("thumb.jpg")
+  #   end
+  #
+  def self.open(thing, *args)
+    if format = image_format(thing)
+      image = read_format(thing, format, *args)
+    elsif thing.respond_to?(:read)
+      head = thing.read(8) || ''
+      image = read_format(unread(thing, head), image_format(head), *args)
+    else
+      format = File.open(thing, 'rb') { |f| image_format(f.read(8)) }
+      if block_given?
+        return open_file(thing) { |f| yield read_format(f, format, *args) }
+      end
+      f = defined?(MappedFile) ? MappedFile.new(thing) : File.open(thing, 'rb')
+      image = read_format(f, format, *args)
+    end
+
+    block_given? ? yield(image) : image
+  end
+
+  # Returns :jpeg or :png if +data+ starts like a JPEG or PNG image.
+  def self.image_format(data) # :nodoc:
+    return nil unless String === data
+
+    if data.unpack('C2') == [0xFF, 0xD8]
+      :jpeg
+    elsif data.unpack('C4') == [0x89, 0x50, 0x4E, 0x47]
+      :png
+    end
+  end
+
+  def self.read_format(thing, format, *args) # :nodoc:
+    case format
+    when :jpeg then jpeg(thing, *args)
+    when :png then png(thing, *args)
+    else raise "Input is not a JPEG or PNG image."
+    end
+  end
+
+  # Puts +head+ back in front of the rest of +io+.
+  def self.unread(io, head) # :nodoc:
+    return io if head.empty?
+
+    if io.respond_to?(:seek)
+      begin
+        io.seek(-head.size, IO::SEEK_CUR)
+        return io
+      rescue SystemCallError
+        # pipes and sockets can't seek
+      end
+    end
+
+    PeekIO.new(head, io)
+  end
+
+  # Reads the start of an IO whose first bytes were taken to detect its
+  # format.
+  class PeekIO # :nodoc:
+    def initialize(head, io)
+      @head, @io = head, io
+    end
+
+    def read(length=nil)
+      return @io.read(length) if @head.empty?
+      return @head.slice!(0, length) if length
+      @head.slice!(0..-1) + (@io.read || '')
+    end
+  end
+
+  def self.probe_io(io) # :nodoc:
+    head = probe_read(io, 8)
+
+    case image_format(head)
+    when :jpeg then probe_jpeg(PeekIO.new(head[2..-1], io))
+    when :png then probe_png(io)
+    else raise "Input is not a JPEG or PNG image."
+    end
+  end
+
+  def self.probe_read(io, length) # :nodoc:
+    data = ''
+    while data.size < length
+      more = io.read(length - data.size)
+      raise "Unexpected end of image header." if more.nil? || more.empty?
+      data << more
+    end
+    data
+  end
+
+  # Reads JPEG markers up to the frame header.
+  def self.probe_jpeg(io) # :nodoc:
+    info = ImageInfo.new(:jpeg)
+    info.orientation = 1
+    jfif = adobe = ids = nil
+
+    loop do
+      marker = 0xFF
+      marker = probe_read(io, 1).unpack('C')[0] while marker == 0xFF
+
+      case marker
+      when 0x01, 0xD0..0xD7
+        next
+      when 0xD9, 0xDA
+        raise "JPEG image has no frame header."
+      end
+
+      length = probe_read(io, 2).unpack('n')[0] - 2
+      raise "Invalid JPEG marker length." if length < 0
+      data = probe_read(io, length)
+
+      case marker
+      when 0xC0..0xCF
+        next if [0xC4, 0xC8, 0xCC].include?(marker)
+
+        info.height, info.width, info.components = data.unpack('xnnC')
+        ids = (0...info.components).map { |i| data.unpack("@#{6 + i * 3}C")[0] }
+        info.progressive = PROGRESSIVE_SOF.include?(marker)
+        break
+      when 0xE0
+        jfif = true if data[0, 5] == "JFIF\0"
+      when 0xE1
+        if data[0, 6] == "Exif\0\0"
+          info.orientation = exif_orientation(data[6..-1]) || 1
+        end
+      when 0xEE
+        adobe = data.unpack('@11C')[0] if data[0, 5] == "Adobe"
+      end
+    end
+
+    info.color_model = jpeg_color_model(info.components, ids, jfif, adobe)
+    info
+  end
+
+  # Guesses the color model of a JPEG the same way libjpeg does.
+  def self.jpeg_color_model(components, ids, jfif, adobe) # :nodoc:
+    case components
+    when 1
+      :GRAYSCALE
+    when 3
+      if jfif then :YCbCr
+      elsif adobe then adobe == 0 ? :RGB : :YCbCr
+      elsif ids == [82, 71, 66] then :RGB
+      else :YCbCr
+      end
+    when 4
+      adobe == 2 ? :YCCK : :CMYK
+    else
+      :UNKNOWN
+    end
+  end
+
+  # Reads PNG chunks up to the first image data.
+  def self.probe_png(io) # :nodoc:
+    info = ImageInfo.new(:png)
+    info.orientation = 1
+    color_type = nil
+
+    loop do
+      length, type = probe_read(io, 8).unpack('Na4')
+      raise "PNG image has no header." unless type == 'IHDR' || color_type
+
+      case type
+      when 'IHDR'
+        data = probe_read(io, length)
+        info.width, info.height, color_type, interlace = data.unpack('NNxCxxC')
+        unless PNG_COLOR_TYPES[color_type]
+          raise "Invalid PNG color type: #{color_type}"
+        end
+        info.components, info.color_model = PNG_COLOR_TYPES[color_type]
+        info.progressive = interlace == 1
+      when 'tRNS'
+        # Palette images are expanded to RGB, with alpha if they have a tRNS.
+        if color_type == 3
+          info.components, info.color_model = 4, :RGB_ALPHA
+        end
+        probe_read(io, length)
+      when 'eXIf'
+        info.orientation = exif_orientation(probe_read(io, length)) || 1
+      when 'IDAT', 'IEND'
+        break
+      else
+        probe_read(io, length)
+      end
+
+      probe_read(io, 4) # CRC
+    end
+
+    info
+  end
+
+  # Returns the orientation tag of the first IFD of Exif data, or nil.
+  def self.exif_orientation(tiff) # :nodoc:
+    case tiff[0, 2]
+    when 'MM' then short, long = 'n', 'N'
+    when 'II' then short, long = 'v', 'V'
+    else return nil
+    end
+
+    ifd = tiff.unpack("@4#{long}")[0]
+    return nil unless ifd && ifd + 2 <= tiff.size
+
+    tiff.unpack("@#{ifd}#{short}")[0].times do |i|
+      entry = ifd + 2 + i * 12
+      return nil if entry + 12 > tiff.size
+
+      tag, type, count, value = tiff.unpack("@#{entry}#{short}2#{long}#{short}")
+      return value if tag == 0x0112 && type == 3
+    end
+
+    nil
+  end
+end
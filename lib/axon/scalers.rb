@@ -46,20 +46,25 @@ module Axon
       @source.components
     end
 
-    # Gets the next scanline from the cropped image.
+    # :call-seq:
+    #   gets([buffer]) -> string or nil
+    #
+    # Gets the next scanline from the scaled image, optionally writing it into
+    # +buffer+.
     #
-    def gets
+    def gets(buffer=nil)
       return nil if @lineno >= @height
       sample = (@lineno * @source.height / @height.to_f).floor
       @lineno += 1
-      Interpolation.nearest(get_buf(sample), @width, components)
+      Interpolation.nearest(get_buf(sample), @width, components, buffer)
     end
 
     private
 
+    # Source scanlines are read into the same buffer over and over.
     def get_buf(line)
       @buf ||= @source.gets
-      (line + 1 - @source.lineno).times{ @buf = @source.gets }
+      (line + 1 - @source.lineno).times{ @buf = Axon.gets_into(@source, @buf) }
       @buf
     end
   end
@@ -114,9 +119,13 @@ module Axon
       @source.components
     end
 
-    # Gets the next scanline from the cropped image.
+    # :call-seq:
+    #   gets([buffer]) -> string or nil
+    #
+    # Gets the next scanline from the scaled image, optionally writing it into
+    # +buffer+.
     #
-    def gets
+    def gets(buffer=nil)
       return nil if @lineno >= @height
       sample = @lineno * @source.height / @height.to_f
       sample_i = sample.to_i
@@ -124,23 +133,114 @@ module Axon
       @lineno += 1
       get_buf(sample_i)
 
-      Interpolation.bilinear(@buf1, @buf2, @width, ty, components)
+      Interpolation.bilinear(@buf1, @buf2, @width, ty, components, buffer)
     end
 
     private
 
+    # The two source scanlines swap places as we move down the image, and the
+    # one that falls out of use is read into again.
     def get_buf(line)
-      @buf1 = @buf2 = read_with_padding unless @buf2
+      unless @buf2
+        @buf2 = read_with_padding(nil)
+        @buf1 = @buf2.dup
+      end
+
       (line + 2 - @source.lineno).times do
-        @buf1 = @buf2
-        @buf2 = read_with_padding if @source.lineno < @source.height
+        if @source.lineno < @source.height
+          @buf1, @buf2 = @buf2, read_with_padding(@buf1)
+        else
+          @buf1 = @buf2
+        end
       end
     end
 
-    def read_with_padding
+    def read_with_padding(buf)
       cmp = @source.components
-      line = @source.gets
-      line + line[-cmp, cmp]
+      line = Axon.gets_into(@source, buf)
+      return line + line[-cmp, cmp] unless buf && line.equal?(buf)
+      line << line[-cmp, cmp]
+    end
+  end
+
+  # == An Area-averaging Image Scaler
+  #
+  # Axon::AreaScaler shrinks images by averaging all of the source pixels that
+  # fall into each pixel of the resulting image.
+  #
+  # Unlike the other scalers it looks at every pixel of the source image, so it
+  # doesn't alias when shrinking by large ratios. It can only shrink images.
+  #
+  # Only one row of running totals is kept in memory, no matter how large the
+  # ratio.
+  #
+  # == Example
+  #
+  #   a = Axon::AreaScaler.new(image_in, 50, 75)
+  #   a.width  # => 50
+  #   a.height # => 75
+  #   a.gets   # => String
+  #
+  class AreaScaler
+    # The width of the generated image.
+    attr_reader :width
+
+    # The height of the generated image.
+    attr_reader :height
+
+    # The index of the next line that will be fetched by gets, starting at 0.
+    attr_reader :lineno
+
+    # :call-seq:
+    #   AreaScaler.new(image_in, width, height)
+    #
+    # Shrinks +image_in+ to the size +width+ x +height+ by averaging areas of
+    # pixels. +width+ and +height+ may not be larger than those of +image_in+.
+    #
+    def initialize(source, width, height)
+      raise ArgumentError if width < 1 || height < 1
+      @width = width
+      @height = height
+      @source = source
+      @lineno = 0
+      @acc = nil
+      @buf = nil
+    end
+
+    # Gets the components in the scaled image. Same as the components of the
+    # source image.
+    #
+    def components
+      @source.components
+    end
+
+    # :call-seq:
+    #   gets([buffer]) -> string or nil
+    #
+    # Gets the next scanline from the scaled image, optionally writing it into
+    # +buffer+.
+    #
+    def gets(buffer=nil)
+      return nil if @lineno >= @height
+
+      unless @acc
+        raise ArgumentError if @width > @source.width
+        raise ArgumentError if @height > @source.height
+        @acc = "\0" * (@width * components * 8)
+      end
+
+      @lineno += 1
+      last = (@lineno * @source.height + @height - 1) / @height
+
+      rows = 0
+      while @source.lineno < last
+        @buf = Axon.gets_into(@source, @buf)
+        Interpolation.area_add(@acc, @buf, @width, components)
+        rows += 1
+      end
+
+      Interpolation.area_emit(@acc, rows, @source.width, @width, components,
+                              buffer)
     end
   end
 end
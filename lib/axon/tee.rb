@@ -0,0 +1,176 @@
+require 'thread'
+
+module Axon
+
+  # == Read an Image Once for Several Consumers
+  #
+  # Axon::Tee reads every scanline of a source image once and hands it to any
+  # number of branches. Each branch is an image of its own that can be scaled
+  # and written like any other.
+  #
+  # Branches are meant to be read at the same time from separate threads. Only
+  # a window of scanlines is kept: a branch that gets +window+ scanlines ahead
+  # of the slowest open branch waits for it to catch up. A branch that won't be
+  # read to the end must be closed so that it doesn't hold the others up.
+  #
+  # The source is read, and its scanlines handed out, under a lock. Branches
+  # save decoding the image more than once, but the decoding itself is not
+  # spread across their threads. What the branches do with the scanlines does
+  # run in parallel: writers read a strip from a branch at a time and run
+  # native stages such as the scalers without the GVL.
+  #
+  # Image#renditions does all of this for you.
+  #
+  # == Example
+  #
+  #   tee = Axon::Tee.new(Axon::Solid.new(100, 200))
+  #   small = Axon::Fit.new(tee.branch, 10, 10)
+  #   large = Axon::Fit.new(tee.branch, 50, 50)
+  #
+  #   t = Thread.new { Axon::PNG.write(small, small_io) }
+  #   Axon::PNG.write(large, large_io)
+  #   t.join
+  #
+  class Tee
+    # :call-seq:
+    #   Tee.new(image_in [, window])
+    #
+    # Shares the scanlines of +image_in+ among branches, keeping at most
+    # +window+ scanlines in memory.
+    #
+    def initialize(source, window=64)
+      raise ArgumentError if window < 1
+      @source, @window = source, window
+      @height = source.height
+      @rows = []
+      @first = 0
+      @positions = {}
+      @lock = Mutex.new
+      @cond = ConditionVariable.new
+    end
+
+    # Returns a new branch. Branches must be made before any of them is read.
+    #
+    def branch
+      @lock.synchronize do
+        if @first > 0 || !@rows.empty?
+          raise "Can't add a branch after the image has been read."
+        end
+        b = Branch.new(self)
+        @positions[b] = 0
+        b
+      end
+    end
+
+    # Gets the components in the image.
+    #
+    def components
+      @source.components
+    end
+
+    # Gets the width of the image.
+    #
+    def width
+      @source.width
+    end
+
+    # Gets the height of the image.
+    #
+    def height
+      @height
+    end
+
+    def gets_for(branch) # :nodoc:
+      @lock.synchronize do
+        i = @positions[branch]
+        return nil if !i || i >= @height
+
+        while i >= @first + @rows.size
+          if @rows.size < @window
+            row = @source.gets
+            return nil unless row
+            @rows << row
+          else
+            @cond.wait(@lock)
+          end
+        end
+
+        @positions[branch] = i + 1
+        row = @rows[i - @first]
+        release
+        row
+      end
+    end
+
+    def close_branch(branch) # :nodoc:
+      @lock.synchronize do
+        @positions.delete(branch)
+        release
+      end
+    end
+
+    private
+
+    # Drops the scanlines every open branch has read.
+    def release
+      low = @positions.values.min || @first + @rows.size
+      return if low <= @first
+
+      @rows.slice!(0, low - @first)
+      @first = low
+      @cond.broadcast
+    end
+
+    # One reader of a Tee, see Tee#branch.
+    class Branch
+      def initialize(tee) # :nodoc:
+        @tee = tee
+        @lineno = 0
+      end
+
+      # Gets the components in the image.
+      #
+      def components
+        @tee.components
+      end
+
+      # Gets the width of the image.
+      #
+      def width
+        @tee.width
+      end
+
+      # Gets the height of the image.
+      #
+      def height
+        @tee.height
+      end
+
+      # Gets the index of the next line that will be fetched by gets, starting
+      # at 0.
+      #
+      def lineno
+        @lineno
+      end
+
+      # :call-seq:
+      #   gets([buffer]) -> string or nil
+      #
+      # Gets the next scanline, optionally copying it into +buffer+. Scanlines
+      # are shared with the other branches and must not be modified.
+      #
+      def gets(buffer=nil)
+        row = @tee.gets_for(self)
+        return nil unless row
+        @lineno += 1
+        buffer ? buffer.replace(row) : row
+      end
+
+      # Stops reading this branch, letting the others run ahead of it.
+      #
+      def close
+        @tee.close_branch(self)
+      end
+    end
+  end
+end
@@ -1,3 +1,5 @@
+require 'tempfile'
+
 module Axon
   module ReaderTests
     def test_header_dimensions
@@ -29,6 +31,84 @@ module Axon
       assert_raises(CustomError) { @readerclass.new io }
     end
 
+    def test_io_raises_exception_while_reading_scanlines
+      header_read = false
+      io = CustomIO.new(Proc.new{ |io, *args| header_read ? raise(CustomError) : io.read(*args) }, @big_data)
+      r = @readerclass.new(io)
+      header_read = true
+      assert_raises(CustomError) do
+        r.height.times { r.gets }
+      end
+    end
+
+    def test_concurrent_reads
+      expected = []
+      r = @readerclass.new(StringIO.new(@big_data))
+      r.height.times { expected << r.gets }
+
+      threads = (1..4).map do
+        Thread.new do
+          reader = @readerclass.new(StringIO.new(@big_data))
+          (1..reader.height).map { reader.gets }
+        end
+      end
+
+      threads.each { |t| assert_equal expected, t.value }
+    end
+
+    def test_mapped_file
+      skip unless defined?(MappedFile)
+      expected = []
+      r = @readerclass.new(StringIO.new(@big_data))
+      r.height.times { expected << r.gets }
+
+      with_data_file(@big_data) do |path|
+        r = @readerclass.new(MappedFile.new(path))
+        assert_equal expected, (1..r.height).map { r.gets }
+      end
+    end
+
+    def test_mapped_file_from_pipe
+      skip unless defined?(MappedFile)
+      rd, wr = IO.pipe
+      path = "/dev/fd/#{rd.fileno}"
+      skip unless File.exist?(path)
+
+      # opening a pipe blocks until it has a writer
+      file = MappedFile.new(path)
+      wr.write(@data)
+      wr.close
+
+      r = @readerclass.new(file)
+      assert_equal r.width * r.components, r.gets.size
+      (r.height - 1).times { r.gets }
+      assert_nil r.gets
+    ensure
+      rd.close if rd
+    end
+
+    def test_string_source
+      expected = []
+      r = @readerclass.new(StringIO.new(@big_data))
+      r.height.times { expected << r.gets }
+
+      data = @big_data.dup
+      r = @readerclass.new(data)
+      data.replace('x')
+      assert_equal expected, (1..r.height).map { r.gets }
+      assert_nil r.gets
+      assert_equal 'x', data
+    end
+
+    def test_empty_string_source
+      assert_raises(RuntimeError) { @readerclass.new('') }
+    end
+
+    def test_mapped_file_missing
+      skip unless defined?(MappedFile)
+      assert_raises(Errno::ENOENT) { MappedFile.new('/nonexistent/axon') }
+    end
+
     def test_not_a_string_io
       assert_raises(TypeError) { @readerclass.new(CustomIO.new(:foo)) }
     end
@@ -51,6 +131,127 @@ module Axon
       assert_equal nil, @reader.gets
     end
     
+    def test_gets_into_buffer
+      expected = []
+      r = @readerclass.new(StringIO.new(@big_data))
+      r.height.times { expected << r.gets }
+
+      r = @readerclass.new(StringIO.new(@big_data))
+      buffer = String.new
+      expected.each do |sl|
+        assert_same buffer, r.gets(buffer)
+        assert_equal sl, buffer
+      end
+      assert_nil r.gets(buffer)
+    end
+
+    def test_gets_locks_buffer
+      buffer = String.new
+      errors = 0
+      io = CustomIO.new(Proc.new do |io, *args|
+        begin
+          buffer.replace("x")
+        rescue RuntimeError
+          errors += 1
+        end
+        io.read(*args)
+      end, @big_data)
+
+      r = @readerclass.new(io)
+      nil while r.gets(buffer)
+
+      assert_operator errors, :>, 0
+      buffer << "x"
+    end
+
+    def test_gets_rows
+      expected = []
+      r = @readerclass.new(StringIO.new(@big_data))
+      r.height.times { expected << r.gets }
+
+      r = @readerclass.new(StringIO.new(@big_data))
+      strips = []
+      while strip = r.gets_rows(7)
+        strips << strip
+      end
+
+      assert_equal (r.height / 7.0).ceil, strips.size
+      assert_equal expected.join, strips.join
+      assert_equal r.height, r.lineno
+      assert_nil r.gets_rows(7)
+    end
+
+    def test_gets_rows_invalid_count
+      assert_raises(ArgumentError) { @reader.gets_rows(0) }
+    end
+
+    def test_push_in_chunks
+      expected = []
+      r = @readerclass.new(StringIO.new(@big_data))
+      r.height.times { expected << r.gets }
+
+      r = @readerclass.new(nil)
+      rows = []
+      (0...@big_data.size).step(100) do |i|
+        r << @big_data[i, 100]
+        r.rows_available.times do
+          assert_equal rows.size, r.lineno
+          rows << r.gets
+        end
+      end
+
+      assert_equal expected, rows
+      assert_equal 0, r.rows_available
+      assert_nil r.gets
+      assert_equal r.height, r.lineno
+    end
+
+    def test_push_all_at_once
+      r = @readerclass.new(nil)
+      r << @data
+      assert_equal @image.width, r.width
+      assert_equal @image.height, r.height
+      assert_equal r.height, r.rows_available
+      assert_equal r.width * r.components * r.height, r.gets_rows(100).size
+      assert_nil r.gets
+    end
+
+    def test_push_needs_more_data
+      r = @readerclass.new(nil)
+      assert_equal 0, r.rows_available
+      assert_raises(RuntimeError) { r.gets }
+
+      r << @big_data[0, @big_data.size / 2]
+      assert_equal 300, r.width
+      n = r.rows_available
+      assert_operator n, :<, r.height
+      assert_raises(RuntimeError) { r.gets_rows(n + 1) }
+
+      r << @big_data[@big_data.size / 2..-1]
+      assert_equal r.height, r.rows_available
+      assert_equal r.height, (1..r.height).map { r.gets }.size
+    end
+
+    def test_push_into_pull_reader
+      assert_raises(RuntimeError) { @reader << @data }
+      assert_raises(RuntimeError) { @reader.rows_available }
+    end
+
+    def test_push_invalid_data
+      r = @readerclass.new(nil)
+      assert_raises(RuntimeError) { r << "not an image at all" }
+    end
+
+    def with_data_file(data)
+      f = Tempfile.new('axon')
+      f.binmode
+      f.write(data)
+      f.close
+      yield f.path
+    ensure
+      f.close!
+    end
+
     def test_recovers_from_initial_io_exception
       ex_io = CustomIO.new(Proc.new{ raise CustomError }, @data)
       r = @readerclass.allocate
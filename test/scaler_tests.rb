@@ -93,6 +93,21 @@ module Axon
       scale_test [0, 0], [-1, 0], [0, -1], [-1, -1]
     end
 
+    def test_gets_into_buffer
+      cache = Repeater.new(Noise.new 30, 20)
+      s = @scalerclass.new(cache, 17, 13)
+      expected = (1..13).map { s.gets }
+
+      cache.rewind
+      s = @scalerclass.new(cache, 17, 13)
+      buffer = String.new
+      expected.each do |sl|
+        assert_same buffer, s.gets(buffer)
+        assert_equal sl, buffer
+      end
+      assert_nil s.gets(buffer)
+    end
+
     def test_small_scaling
       im = Solid.new(10, 20)
       sc = @scalerclass.new(im, 2, 5)
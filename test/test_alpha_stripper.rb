@@ -16,6 +16,49 @@ module Axon
       assert_image_dimensions noalpha, 20, 30
     end
 
+    def test_strip_rgb_alpha_values
+      data = (0...40).to_a.pack('C*')
+      im = ArrayWrapper.new([data], 4)
+      def im.width; 10; end
+
+      sl = AlphaStripper.new(im).gets
+      expected = (0...40).reject { |i| i % 4 == 3 }
+      assert_equal expected, sl.unpack('C*')
+    end
+
+    def test_strip_grayscale_alpha_values
+      im = Solid.new(5, 2, [7, 200].pack('C*'))
+      sl = AlphaStripper.new(im).gets
+      assert_equal [7] * 5, sl.unpack('C*')
+    end
+
+    def test_flatten_onto_background
+      bg = [255, 255, 255].pack('C*')
+      [
+        [255, [10, 20, 30]],
+        [0, [255, 255, 255]],
+        [128, [132, 137, 142]]
+      ].each do |a, px|
+        im = Solid.new(17, 3, [10, 20, 30, a].pack('C*'))
+        noalpha = AlphaStripper.new(im, :background => bg)
+        assert_equal 3, noalpha.components
+        3.times { assert_equal px * 17, noalpha.gets.unpack('C*') }
+        assert_nil noalpha.gets
+      end
+    end
+
+    def test_flatten_grayscale
+      im = Solid.new(3, 1, [100, 51].pack('C*'))
+      noalpha = AlphaStripper.new(im, :background => [0].pack('C'))
+      assert_equal [20] * 3, noalpha.gets.unpack('C*')
+    end
+
+    def test_bad_background
+      im = Solid.new(3, 1, [1, 2, 3, 4].pack('C*'))
+      noalpha = AlphaStripper.new(im, :background => [0].pack('C'))
+      assert_raises(ArgumentError) { noalpha.gets }
+    end
+
     def test_leaves_grayscale_untouched
       im = Solid.new(20, 30, "\x00")
       noalpha = AlphaStripper.new(im)
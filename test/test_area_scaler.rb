@@ -0,0 +1,86 @@
+require 'helper'
+
+module Axon
+  class TestAreaScaler < AxonTestCase
+    def test_dimensions
+      [[7, 8], [71, 82], [100, 200], [1, 1]].each do |w, h|
+        s = AreaScaler.new(Solid.new(100, 200), w, h)
+        assert_image_dimensions(s, w, h)
+      end
+    end
+
+    def test_bad_dimensions
+      [ [0, 0], [0, 1], [1, 0], [-1, -3] ].each do |w, h|
+        assert_raises(ArgumentError) { AreaScaler.new(@image, w, h).gets }
+      end
+    end
+
+    def test_can_not_enlarge
+      assert_raises(ArgumentError) { AreaScaler.new(@image, 11, 16).gets }
+      assert_raises(ArgumentError) { AreaScaler.new(@image, 10, 17).gets }
+    end
+
+    def test_solid_color
+      s = AreaScaler.new(Solid.new(30, 40, "\x0A\x14\x69"), 7, 9)
+      9.times { assert_equal "\x0A\x14\x69" * 7, s.gets }
+      assert_nil s.gets
+    end
+
+    def test_pixel_values
+      cache = Repeater.new(Noise.new(37, 23))
+      data = (1..23).map { cache.gets.unpack('C*') }
+      cache.rewind
+
+      [[37, 23], [10, 7], [18, 11], [1, 1]].each do |w, h|
+        cache.rewind
+        s = AreaScaler.new(cache, w, h)
+
+        h.times do |y|
+          rows = (0...23).select { |sy| sy * h / 23 == y }
+          result = s.gets.unpack('C*')
+
+          w.times do |x|
+            cols = (0...37).select { |sx| sx * w / 37 == x }
+            3.times do |c|
+              sum = 0
+              rows.each { |sy| cols.each { |sx| sum += data[sy][sx * 3 + c] } }
+              count = rows.size * cols.size
+              assert_equal (sum + count / 2) / count, result[x * 3 + c]
+            end
+          end
+        end
+
+        assert_equal h, s.lineno
+        assert_equal 23, cache.lineno
+      end
+    end
+
+    def test_gets_into_buffer
+      cache = Repeater.new(Noise.new 30, 20)
+      s = AreaScaler.new(cache, 7, 6)
+      expected = (1..6).map { s.gets }
+
+      cache.rewind
+      s = AreaScaler.new(cache, 7, 6)
+      buffer = String.new
+      expected.each do |sl|
+        assert_same buffer, s.gets(buffer)
+        assert_equal sl, buffer
+      end
+    end
+
+    def test_large_source_to_one_pixel
+      image = Image.new(Solid.new(6000, 6000, "\xFF\x80\x01"))
+      assert_equal [255, 128, 1], image.scale_area(1, 1).gets.unpack('C*')
+
+      s = AreaScaler.new(Solid.new(6000, 6000, "\xFF"), 1, 1)
+      assert_equal [255], s.gets.unpack('C*')
+    end
+
+    def test_fit_uses_area_scaler_for_large_reductions
+      im = Solid.new(100, 200)
+      assert_kind_of AreaScaler, Fit.new(im, 10, 20).send(:scaler)
+      assert_kind_of BilinearScaler, Fit.new(im, 60, 120).send(:scaler)
+    end
+  end
+end
@@ -0,0 +1,121 @@
+require 'helper'
+require 'tempfile'
+
+module Axon
+  class TestBatch < AxonTestCase
+    def setup
+      super
+      io = StringIO.new
+      JPEG.write(Solid.new(40, 20), io)
+      @jpeg_data = io.string
+
+      io = StringIO.new
+      PNG.write(Solid.new(30, 60), io)
+      @png_data = io.string
+    end
+
+    def test_string_to_string
+      results = Axon.batch([{ :input => @jpeg_data,
+                              :operations => [[:fit, 20, 20]] }])
+
+      image = Axon.jpeg(results[0])
+      assert_image_dimensions(image, 20, 10)
+    end
+
+    def test_png_output
+      results = Axon.batch([{ :input => @jpeg_data, :format => :png }])
+      image = Axon.png(results[0])
+      assert_image_dimensions(image, 40, 20)
+    end
+
+    def test_file_to_file
+      with_tempfile(@png_data) do |path|
+        out = path + '.jpg'
+        begin
+          results = Axon.batch([{ :input => path, :output => out,
+                                  :operations => [[:crop, 10, 15, 5, 5]],
+                                  :options => { :quality => 50 } }])
+
+          assert_equal File.size(out), results[0]
+          Axon.jpeg_file(out) { |image| assert_image_dimensions(image, 10, 15) }
+        ensure
+          File.delete(out) if File.exist?(out)
+        end
+      end
+    end
+
+    def test_png_file_output
+      with_tempfile(@jpeg_data) do |path|
+        out = path + '.png'
+        begin
+          Axon.batch([{ :input => path, :output => out }])
+          Axon.png_file(out) { |image| assert_image_dimensions(image, 40, 20) }
+        ensure
+          File.delete(out) if File.exist?(out)
+        end
+      end
+    end
+
+    def test_threads_keep_job_order
+      jobs = (1..12).map do |i|
+        { :input => i.odd? ? @jpeg_data : @png_data,
+          :operations => [[:scale_bilinear, i, i * 2]] }
+      end
+
+      results = Axon.batch(jobs, :threads => 3)
+
+      assert_equal 12, results.size
+      results.each_with_index do |data, i|
+        image = Axon.jpeg(data)
+        assert_image_dimensions(image, i + 1, (i + 1) * 2)
+      end
+    end
+
+    def test_small_fit_is_native
+      calls = 0
+      trace = TracePoint.new(:call) do |tp|
+        calls += 1 if tp.defined_class == AreaScaler && tp.method_id == :gets
+      end
+
+      jobs = [{ :input => @png_data, :operations => [[:fit, 10, 10]] }] * 4
+      trace.enable
+      results = Axon.batch(jobs, :threads => 2)
+      trace.disable
+
+      assert_equal 0, calls
+      results.each { |data| assert_image_dimensions(Axon.jpeg(data), 5, 10) }
+    end
+
+    def test_errors_per_job
+      results = Axon.batch([{ :input => "not an image path" },
+                            { :input => @jpeg_data },
+                            { :input => @jpeg_data,
+                              :operations => [[:instance_eval, "1"]] }],
+                           :threads => 2)
+
+      assert_kind_of StandardError, results[0]
+      assert_kind_of String, results[1]
+      assert_kind_of ArgumentError, results[2]
+    end
+
+    def test_empty_batch
+      assert_equal [], Axon.batch([], :threads => 4)
+    end
+
+    def test_invalid_threads
+      assert_raises(ArgumentError) { Axon.batch([], :threads => 0) }
+    end
+
+    private
+
+    def with_tempfile(data)
+      f = Tempfile.new('axon')
+      f.binmode
+      f.write(data)
+      f.close
+      yield f.path
+    ensure
+      f.close!
+    end
+  end
+end
@@ -67,6 +67,42 @@ module Axon
       assert_equal 51, c.lineno
     end
 
+    def test_crop_into_buffer
+      io = StringIO.new
+      PNG.write(Noise.new(100, 200), io)
+      data = []
+      r = PNG::Reader.new(StringIO.new(io.string))
+      r.height.times { data << r.gets }
+
+      c = Cropper.new(PNG::Reader.new(StringIO.new(io.string)), 42, 51, 22, 31)
+      buffer = String.new
+      51.times do |i|
+        assert_same buffer, c.gets(buffer)
+        assert_equal data[i + 31][22 * 3, 42 * 3], buffer
+      end
+      assert_nil c.gets(buffer)
+    end
+
+    def test_crop_jpeg_in_decoder
+      io = StringIO.new
+      JPEG.write(Noise.new(301, 207), io)
+
+      [[50, 40, 0, 0], [64, 30, 17, 33], [13, 7, 288, 200]].each do |crop|
+        full = JPEG::Reader.new(StringIO.new(io.string))
+        rows = (1..full.height).map { full.gets }
+        w, h, x, y = crop
+
+        c = Cropper.new(JPEG::Reader.new(StringIO.new(io.string)), *crop)
+        assert_equal w, c.width
+        assert_equal h, c.height
+
+        h.times do |i|
+          assert_equal rows[y + i][x * 3, w * 3], c.gets
+        end
+        assert_nil c.gets
+      end
+    end
+
     def test_crop_with_offset_oob
       i = Solid.new(200, 100)
       c = Cropper.new(i, 30, 40, 220, 10)
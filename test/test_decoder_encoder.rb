@@ -0,0 +1,160 @@
+require 'helper'
+
+module Axon
+  class TestDecoderEncoder < AxonTestCase
+    def test_jpeg_encoder_matches_encode
+      encoder = JPEG::Encoder.new(:quality => 70, :exif => "exif data")
+
+      [:solid, :gray, :solid].each do |image|
+        expected = JPEG.encode(send(image), :quality => 70, :exif => "exif data")
+        assert_equal expected, encoder.encode(send(image))
+      end
+    end
+
+    def test_jpeg_encoder_write
+      encoder = JPEG::Encoder.new(:bufsize => 7)
+      2.times do
+        io = StringIO.new
+        size = encoder.write(solid, io)
+        assert_equal io.string.size, size
+        assert_equal JPEG.encode(solid), io.string
+      end
+    end
+
+    def test_jpeg_encoder_progressive_and_threads
+      encoder = JPEG::Encoder.new(:progressive => true)
+      assert_equal JPEG.encode(solid, :progressive => true), encoder.encode(solid)
+      assert_equal JPEG.encode(gray, :progressive => true), encoder.encode(gray)
+
+      encoder = JPEG::Encoder.new(:threads => 3)
+      2.times do
+        data = encoder.encode(Noise.new(200, 300))
+        assert_image_dimensions(Axon.jpeg(data), 200, 300)
+      end
+    end
+
+    def test_jpeg_encoder_recovers_from_errors
+      encoder = JPEG::Encoder.new
+      assert_raises(RuntimeError) { encoder.encode(Solid.new(10, 10, "\x01\x02")) }
+      assert_equal JPEG.encode(solid), encoder.encode(solid)
+    end
+
+    def test_jpeg_encoder_invalid_options
+      assert_raises(RuntimeError) { JPEG::Encoder.new(:quality => 80, :bufsize => 0) }
+      assert_raises(RuntimeError) { JPEG::Encoder.new(:profile => :foo) }
+    end
+
+    def test_jpeg_decoder
+      first = JPEG.encode(solid)
+      second = JPEG.encode(gray)
+      decoder = JPEG::Decoder.new
+
+      assert_same decoder, decoder.decode(first)
+      assert_equal 3, decoder.components
+      assert_image_dimensions(decoder, 33, 21)
+
+      decoder.decode(second)
+      assert_equal 0, decoder.lineno
+      assert_equal 1, decoder.components
+      assert_equal reader_rows(JPEG::Reader.new(second)), reader_rows(decoder)
+
+      decoder.decode(StringIO.new(first))
+      assert_equal reader_rows(JPEG::Reader.new(first)), reader_rows(decoder)
+    end
+
+    def test_jpeg_decoder_resets_options
+      decoder = JPEG::Decoder.new
+      decoder.decode(JPEG.encode(Solid.new(40, 20)))
+      decoder.scale_denom = 2
+      decoder.threads = 2
+      assert_equal 20, decoder.width
+      decoder.gets
+
+      decoder.decode(JPEG.encode(Solid.new(40, 20)))
+      assert_equal 40, decoder.width
+      assert_equal 2, decoder.threads
+    end
+
+    def test_jpeg_decoder_markers
+      data = JPEG.encode(solid, :exif => "exif data")
+      decoder = JPEG::Decoder.new
+
+      decoder.decode(data)
+      assert_equal "exif data", decoder.exif
+      decoder.decode(data, [:APP2])
+      assert_nil decoder.exif
+      decoder.decode(data)
+      assert_equal "exif data", decoder.exif
+    end
+
+    def test_jpeg_decoder_recovers_from_errors
+      decoder = JPEG::Decoder.new
+      assert_raises(RuntimeError) { decoder.gets }
+      assert_raises(RuntimeError) { decoder.decode("not a jpeg") }
+      assert_raises(TypeError) { decoder.decode(nil) }
+
+      decoder.decode(JPEG.encode(solid))
+      assert_image_dimensions(decoder, 33, 21)
+    end
+
+    def test_jpeg_decoder_as_image_source
+      decoder = JPEG::Decoder.new
+      decoder.decode(JPEG.encode(solid))
+      image = Image.new(decoder).scale_bilinear(10, 5)
+      assert_image_dimensions(Axon.png(image.png_data), 10, 5)
+    end
+
+    def test_png_encoder
+      encoder = PNG::Encoder.new(:preset => :fast)
+
+      [:solid, :gray].each do |image|
+        expected = PNG.encode(send(image), :preset => :fast)
+        assert_equal expected, encoder.encode(send(image))
+
+        io = StringIO.new
+        size = encoder.write(send(image), io)
+        assert_equal io.string.size, size
+        assert_equal expected, io.string
+      end
+
+      assert_raises(RuntimeError) { PNG::Encoder.new(:compression => 10) }
+    end
+
+    def test_png_decoder
+      first = PNG.encode(solid)
+      second = PNG.encode(Solid.new(13, 7, "\x80\x10"))
+      decoder = PNG::Decoder.new
+
+      assert_nil decoder.gets
+      assert_same decoder, decoder.decode(first)
+      assert_image_dimensions(decoder, 33, 21)
+
+      decoder.decode(StringIO.new(second), :bufsize => 5)
+      assert_equal 0, decoder.lineno
+      assert_equal 2, decoder.components
+      assert_equal reader_rows(PNG::Reader.new(second)), reader_rows(decoder)
+
+      assert_raises(RuntimeError) { decoder.decode("not a png") }
+      decoder.decode(first)
+      assert_equal reader_rows(PNG::Reader.new(first)), reader_rows(decoder)
+    end
+
+    private
+
+    def solid
+      Solid.new(33, 21)
+    end
+
+    def gray
+      Solid.new(12, 40, "\x80")
+    end
+
+    def reader_rows(reader)
+      rows = []
+      while row = reader.gets
+        rows << row
+      end
+      rows
+    end
+  end
+end
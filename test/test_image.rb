@@ -34,6 +34,23 @@ module Axon
       assert_image_dimensions(image, 10, 20)
     end
 
+    def test_jpeg_file_helper
+      with_tempfile(@jpeg_data) do |path|
+        Axon.jpeg_file(path) { |image| assert_image_dimensions(image, 10, 20) }
+      end
+    end
+
+    def test_png_file_helper
+      with_tempfile(@png_data) do |path|
+        Axon.png_file(path) { |image| assert_image_dimensions(image, 10, 20) }
+      end
+    end
+
+    def test_jpeg_and_png_data
+      assert_image_dimensions(Axon.jpeg(Axon.png(@png_data).jpeg_data), 10, 20)
+      assert_image_dimensions(Axon.png(Axon.jpeg(@jpeg_data).png_data), 10, 20)
+    end
+
     def test_bilinear
       image = Axon.jpeg(@jpeg_data)
       image.scale_bilinear(50, 75)
@@ -57,5 +74,54 @@ module Axon
       image.crop(5, 10, 6, 2)
       assert_image_dimensions(image, 4, 10)
     end
+
+    def test_renditions
+      io = StringIO.new
+      JPEG.write(Noise.new(400, 200), io)
+      image = Axon.jpeg(io.string)
+
+      results = image.renditions([
+        { :operations => [[:fit, 100, 100]] },
+        { :operations => [[:fit, 20, 20]], :format => :png },
+        { :operations => [[:crop, 10, 10]] }
+      ])
+
+      assert_image_dimensions(Axon.jpeg(results[0]), 100, 50)
+      assert_image_dimensions(Axon.png(results[1]), 20, 10)
+      assert_image_dimensions(Axon.jpeg(results[2]), 10, 10)
+    end
+
+    def test_renditions_use_dct_scaling
+      io = StringIO.new
+      JPEG.write(Noise.new(400, 200), io)
+      image = Axon.jpeg(io.string)
+
+      results = image.renditions([{ :operations => [[:fit, 100, 100]] },
+                                  { :operations => [[:fit, 40, 40]] }])
+
+      assert image.width < 400
+      assert image.width >= 100
+      assert_image_dimensions(Axon.jpeg(results[0]), 100, 50)
+    end
+
+    def test_renditions_error
+      image = Axon.jpeg(@jpeg_data)
+      assert_raises(ArgumentError) do
+        image.renditions([{ :operations => [[:fit, 5, 5]] },
+                          { :operations => [[:upcase]] }])
+      end
+    end
+
+    private
+
+    def with_tempfile(data)
+      f = Tempfile.new('axon')
+      f.binmode
+      f.write(data)
+      f.close
+      yield f.path
+    ensure
+      f.close!
+    end
   end
 end
@@ -0,0 +1,73 @@
+require 'helper'
+
+module Axon
+  class TestInterpolation < AxonTestCase
+    def teardown
+      Interpolation.simd = true
+    end
+
+    def padded_scanline(width, components)
+      sl = Noise.new(width, 1, :components => components).gets
+      sl + sl[-components, components]
+    end
+
+    # :baseline picks the kernels the compiler targets, such as SSE2 or NEON,
+    # and true adds the ones picked at runtime, such as AVX2.
+    def test_simd_matches_scalar
+      [1, 2, 3, 4].each do |cmp|
+        [1, 7, 33, 130].each do |src_width|
+          sl1 = padded_scanline(src_width, cmp)
+          sl2 = padded_scanline(src_width, cmp)
+
+          [1, 2, 5, 16, 47, 131].each do |width|
+            [0, 0.3, 0.5, 0.99].each do |ty|
+              Interpolation.simd = false
+              scalar = Interpolation.bilinear(sl1, sl2, width, ty, cmp)
+
+              [:baseline, true].each do |simd|
+                Interpolation.simd = simd
+                assert_equal scalar,
+                             Interpolation.bilinear(sl1, sl2, width, ty, cmp)
+              end
+            end
+          end
+        end
+      end
+    end
+
+    def test_strip_alpha_simd_matches_scalar
+      (1..21).each do |width|
+        sl = Noise.new(width, 1, :components => 4).gets
+        Interpolation.simd = true
+        simd = Interpolation.strip_alpha(sl, 4)
+        Interpolation.simd = false
+        scalar = Interpolation.strip_alpha(sl, 4)
+
+        assert_equal scalar, simd
+        assert_equal width * 3, simd.size
+      end
+    end
+
+    def test_scalar_kernel
+      Interpolation.simd = false
+      assert_equal 'scalar', Interpolation.kernel
+    end
+
+    def test_bilinear_corners
+      sl1 = [0, 0, 255, 255].pack('C*')
+      sl2 = [255, 255, 0, 0].pack('C*')
+
+      [[0, [0, 128]], [1, [255, 128]], [0.5, [128, 128]]].each do |ty, px|
+        sl = Interpolation.bilinear(sl1, sl2, 2, ty, 1)
+        assert_equal px, sl.unpack('C*')
+      end
+    end
+
+    def test_bilinear_into_source
+      sl = "\x00\x00\xff\xff"
+      assert_raises(ArgumentError) do
+        Interpolation.bilinear(sl, sl.dup, 2, 0, 1, sl)
+      end
+    end
+  end
+end
@@ -11,10 +11,114 @@ module Axon
         io = StringIO.new
         JPEG.write(@image, io)
         @data = io.string
+
+        io = StringIO.new
+        JPEG.write(Noise.new(300, 200), io)
+        @big_data = io.string
+
         @readerclass = Reader
         @reader = Reader.new(StringIO.new(@data))
       end
 
+      def test_decode_window
+        r = Reader.new(StringIO.new(@big_data))
+        skip unless r.respond_to?(:decode_window)
+
+        x = r.decode_window(100, 50, 30)
+        assert x <= 100
+        assert r.width >= 130 - x
+        assert r.width < 300
+        assert_equal 50, r.lineno
+        assert_equal r.width * 3, r.gets.size
+        assert_raises(RuntimeError) { r.scale_num = 4 }
+      end
+
+      def test_decode_window_outside_image
+        skip unless @reader.respond_to?(:decode_window)
+        assert_raises(ArgumentError) { @reader.decode_window(5, 0, 6) }
+      end
+
+      def test_threads
+        io = StringIO.new
+        JPEG.write(Noise.new(1000, 1200), io, :threads => 4)
+        data = io.string
+
+        r = Reader.new(data)
+        r.threads = 3
+        assert_equal 3, r.threads
+        assert_equal read_all(Reader.new(data)), read_all(r)
+        assert_equal 1200, r.lineno
+        assert_nil r.gets
+      end
+
+      def test_threads_scaled
+        io = StringIO.new
+        JPEG.write(Noise.new(1000, 1200), io, :threads => 4)
+        data = io.string
+
+        readers = [1, 2].map do |threads|
+          r = Reader.new(data)
+          r.scale_num = 3
+          r.scale_denom = 8
+          r.threads = threads
+          r
+        end
+
+        assert_equal read_all(readers[0]), read_all(readers[1])
+      end
+
+      def test_threads_without_restart_markers
+        r = Reader.new(@big_data)
+        r.threads = 4
+        assert_equal read_all(Reader.new(@big_data)), read_all(r)
+      end
+
+      def test_threads_from_io
+        io = StringIO.new
+        JPEG.write(Noise.new(300, 200), io, :threads => 2)
+
+        r = Reader.new(StringIO.new(io.string))
+        r.threads = 2
+        assert_equal read_all(Reader.new(io.string)), read_all(r)
+      end
+
+      def test_threads_in_use
+        io = StringIO.new
+        JPEG.write(Noise.new(1500, 1500), io, :threads => 4)
+
+        r = Reader.new(io.string)
+        r.threads = 4
+        error = nil
+        done = false
+
+        t = Thread.new do
+          until done || error
+            begin
+              r.gets
+            rescue RuntimeError => e
+              error = e
+            end
+            Thread.pass
+          end
+        end
+
+        begin
+          nil while r.gets
+        rescue RuntimeError => e
+          error ||= e
+        end
+        done = true
+        t.join
+
+        assert_match(/already in use/, error.message)
+      end
+
+      def test_invalid_threads
+        assert_raises(RuntimeError) { @reader.threads = 0 }
+        @reader.gets
+        assert_raises(RuntimeError) { @reader.threads = 2 }
+      end
+
       def test_in_color_model
         skip unless @reader.respond_to?(:in_color_model)
         assert_equal :YCbCr, @reader.in_color_model
@@ -129,6 +233,44 @@ module Axon
         assert_raises(RuntimeError) { @reader.dct_method = :IFAST }
         assert_raises(RuntimeError) { @reader.scale_denom = 4 }
       end
+
+      def test_push_progressive
+        io = StringIO.new
+        JPEG.write(Noise.new(120, 90), io, :progressive => true)
+        expected = read_all(Reader.new(io.string))
+
+        r = Reader.new(nil)
+        rows = []
+        (0...io.string.size).step(50) do |i|
+          r << io.string[i, 50]
+          r.rows_available.times { rows << r.gets }
+        end
+
+        assert_equal expected, rows.join
+      end
+
+      def test_push_set_options_after_header
+        r = Reader.new(nil)
+        r << @big_data[0, 1000]
+        r.scale_denom = 4
+        r.color_model = :GRAYSCALE
+        r << @big_data[1000..-1]
+
+        assert_equal [75, 50], [r.width, r.height]
+        assert_equal 50, r.rows_available
+        assert_equal 75, r.gets.size
+        assert_raises(RuntimeError) { r.scale_denom = 2 }
+      end
+
+      private
+
+      def read_all(reader)
+        rows = []
+        while row = reader.gets_rows(100)
+          rows << row
+        end
+        rows.join
+      end
     end
   end
 end
@@ -0,0 +1,192 @@
+require 'helper'
+
+module Axon
+  class TestJPEGTransform < AxonTestCase
+    def setup
+      super
+      # A smooth grayscale image, so that decoding the transformed
+      # image matches transforming the decoded pixels.
+      noise = Image.new(Noise.new(8, 6, :components => 1))
+      io = StringIO.new
+      JPEG.write(noise.scale_bilinear(64, 48), io, :quality => 95)
+      @jpeg = io.string
+      @pixels = decode(@jpeg)
+    end
+
+    def test_rotate
+      out = transform(:rotate => 90)
+      assert_equal [48, 64], dimensions(out)
+      assert_pixels(out) { |x, y| @pixels[47 - x][y] }
+
+      out = transform(:rotate => 180)
+      assert_equal [64, 48], dimensions(out)
+      assert_pixels(out) { |x, y| @pixels[47 - y][63 - x] }
+
+      out = transform(:rotate => 270)
+      assert_equal [48, 64], dimensions(out)
+      assert_pixels(out) { |x, y| @pixels[x][63 - y] }
+    end
+
+    def test_flip
+      assert_pixels(transform(:flip => :horizontal)) { |x, y| @pixels[y][63 - x] }
+      assert_pixels(transform(:flip => :vertical)) { |x, y| @pixels[47 - y][x] }
+    end
+
+    def test_rotate_then_flip
+      out = transform(:rotate => 90, :flip => :horizontal)
+      assert_pixels(out) { |x, y| @pixels[x][y] }
+    end
+
+    def test_rotate_twice
+      once = transform(:rotate => 180)
+      io = StringIO.new
+      JPEG.transform(once, io, :rotate => 180)
+      assert_equal @pixels, decode(io.string)
+    end
+
+    def test_crop
+      out = transform(:crop => [10, 20, 30, 20])
+      assert_equal [32, 24], dimensions(out)
+      assert_pixels(out) { |x, y| @pixels[16 + y][8 + x] }
+    end
+
+    def test_trims_partial_blocks
+      io = StringIO.new
+      JPEG.write(Solid.new(77, 53), io)
+
+      out = StringIO.new
+      JPEG.transform(io.string, out, :rotate => 90)
+      assert_equal [48, 77], dimensions(out.string)
+
+      out = StringIO.new
+      JPEG.transform(io.string, out)
+      assert_equal [77, 53], dimensions(out.string)
+    end
+
+    def test_returns_bytes_written
+      io = StringIO.new
+      assert_equal JPEG.transform(@jpeg, io, :bufsize => 7), io.string.size
+    end
+
+    def test_resets_exif_orientation
+      exif = ["MM", 42, 8, 1, 0x0112, 3, 1, 6, 0, 0].pack('a2nNnnnNnnN')
+      io = StringIO.new
+      JPEG.write(@image, io, :exif => exif, :icc_profile => "profile")
+
+      out = StringIO.new
+      JPEG.transform(io.string, out, :rotate => 90)
+      reader = JPEG::Reader.new(out.string)
+
+      assert_equal 1, reader.exif.unpack('a2nNnnnNnnN')[7]
+      assert_equal "profile", reader.icc_profile
+    end
+
+    def test_keeps_progressive
+      io = StringIO.new
+      JPEG.write(Solid.new(32, 32), io, :progressive => true)
+
+      out = StringIO.new
+      JPEG.transform(io.string, out, :rotate => 270)
+      assert_equal "\xFF\xC2".unpack('C*'), sof(out.string)
+
+      out = StringIO.new
+      JPEG.transform(io.string, out, :progressive => false)
+      refute_equal "\xFF\xC2".unpack('C*'), sof(out.string)
+    end
+
+    def test_invalid_options
+      assert_raises(RuntimeError) { transform(:rotate => 45) }
+      assert_raises(RuntimeError) { transform(:flip => :diagonal) }
+      assert_raises(RuntimeError) { transform(:crop => [1, 2]) }
+      assert_raises(RuntimeError) { transform(:crop => [64, 0, 8, 8]) }
+      assert_raises(RuntimeError) { transform(:crop => [0, 0, 0, 8]) }
+      assert_raises(RuntimeError) { transform(:bufsize => 0) }
+    end
+
+    def test_invalid_input
+      assert_raises(RuntimeError) { JPEG.transform("not a jpeg", StringIO.new) }
+    end
+
+    def test_optimize
+      io = StringIO.new
+      JPEG.write(Noise.new(200, 100), io, :quality => 90)
+
+      out = StringIO.new
+      size = JPEG.optimize(io.string, out)
+
+      assert_equal out.string.size, size
+      assert_operator size, :<, io.string.size
+      assert_equal decode(io.string), decode(out.string)
+    end
+
+    def test_optimize_progressive
+      out = StringIO.new
+      JPEG.optimize(@jpeg, out, :progressive => true)
+
+      assert_equal "\xFF\xC2".unpack('C*'), sof(out.string)
+      assert_equal @pixels, decode(out.string)
+    end
+
+    def test_optimize_keep_markers
+      io = StringIO.new
+      JPEG.write(@image, io, :exif => "exif data", :icc_profile => "profile")
+
+      out = StringIO.new
+      JPEG.optimize(io.string, out)
+      reader = JPEG::Reader.new(out.string)
+      assert_equal "exif data", reader.exif
+      assert_equal "profile", reader.icc_profile
+
+      out = StringIO.new
+      JPEG.optimize(io.string, out, :keep_markers => [:APP2])
+      reader = JPEG::Reader.new(out.string)
+      assert_nil reader.exif
+      assert_equal "profile", reader.icc_profile
+      assert reader.saw_jfif_marker
+
+      out = StringIO.new
+      JPEG.optimize(io.string, out, :keep_markers => [])
+      reader = JPEG::Reader.new(out.string)
+      assert_nil reader.exif
+      assert_nil reader.icc_profile
+    end
+
+    def test_optimize_invalid_marker
+      assert_raises(RuntimeError) do
+        JPEG.optimize(@jpeg, StringIO.new, :keep_markers => [:FOO])
+      end
+    end
+
+    private
+
+    def transform(options)
+      io = StringIO.new
+      JPEG.transform(@jpeg, io, options)
+      io.string
+    end
+
+    def decode(data)
+      r = JPEG::Reader.new(data)
+      (1..r.height).map { r.gets.unpack('C*') }
+    end
+
+    def dimensions(data)
+      r = JPEG::Reader.new(data)
+      [r.width, r.height]
+    end
+
+    def sof(data)
+      data.unpack('C*').each_cons(2).find { |a, b| a == 0xFF && (0xC0..0xC2).include?(b) }
+    end
+
+    # Pixels of the transformed image are within rounding of the source pixel
+    # the block gives for each (x, y).
+    def assert_pixels(data)
+      decode(data).each_with_index do |row, y|
+        row.each_with_index do |value, x|
+          assert_in_delta yield(x, y), value, 1
+        end
+      end
+    end
+  end
+end
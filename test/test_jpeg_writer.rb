@@ -34,6 +34,144 @@ module Axon
       end
     end
 
+    def test_threads
+      [[3, 1001, 517], [1, 777, 301], [3, 5000, 50], [3, 33, 17]].each do |c, w, h|
+        io = StringIO.new
+        JPEG.write(Noise.new(w, h, :components => c), io)
+        data = io.string
+
+        single = StringIO.new
+        JPEG.write(JPEG::Reader.new(data), single)
+
+        threaded = StringIO.new
+        size = JPEG.write(JPEG::Reader.new(data), threaded, :threads => 4,
+                          :exif => "foo")
+        assert_equal threaded.size, size
+
+        assert_equal decode(single.string), decode(threaded.string)
+      end
+    end
+
+    def test_threads_restart_markers
+      io = StringIO.new
+      JPEG.write(Noise.new(1001, 517), io, :threads => 2)
+      bytes = io.string.unpack('C*')
+
+      markers = []
+      bytes.each_cons(2) do |a, b|
+        markers << b if a == 0xFF && (0xD0..0xD7).include?(b)
+      end
+
+      assert markers.size > 0
+      assert_equal (0...markers.size).map { |i| 0xD0 + i % 8 }, markers
+      assert_equal [0xFF, 0xD9], bytes[-2..-1]
+    end
+
+    def test_invalid_threads
+      assert_raises RuntimeError do
+        JPEG.write(@image, @io_out, :threads => 0)
+      end
+    end
+
+    def test_optimize_coding
+      io = StringIO.new
+      JPEG.write(Noise.new(200, 100), io)
+
+      plain = StringIO.new
+      JPEG.write(JPEG::Reader.new(io.string), plain)
+
+      optimized = StringIO.new
+      JPEG.write(JPEG::Reader.new(io.string), optimized,
+                 :optimize_coding => true)
+
+      assert optimized.size < plain.size
+      assert_equal decode(plain.string), decode(optimized.string)
+    end
+
+    def test_progressive
+      JPEG.write(Noise.new(200, 100), @io_out, :progressive => true)
+      assert_equal 0xC2, frame(@io_out.string)[0]
+      assert_equal 100, decode(@io_out.string).size
+    end
+
+    def test_progressive_ignores_threads
+      JPEG.write(Noise.new(1000, 600), @io_out, :progressive => true,
+                 :threads => 4)
+      assert_equal 0xC2, frame(@io_out.string)[0]
+      assert_equal 600, decode(@io_out.string).size
+    end
+
+    def test_subsampling
+      { '4:4:4' => 0x11, '4:2:2' => 0x21, '4:2:0' => 0x22,
+        '4:4:0' => 0x12 }.each do |subsampling, factors|
+        io = StringIO.new
+        JPEG.write(Noise.new(50, 40), io, :subsampling => subsampling)
+        assert_equal factors, frame(io.string)[1]
+      end
+    end
+
+    def test_subsampling_with_threads
+      io = StringIO.new
+      JPEG.write(Noise.new(1001, 517), io, :subsampling => '4:4:4',
+                 :threads => 3)
+      assert_equal 0x11, frame(io.string)[1]
+      assert_equal 517, decode(io.string).size
+    end
+
+    def test_invalid_subsampling
+      assert_raises RuntimeError do
+        JPEG.write(@image, @io_out, :subsampling => '4:1:3')
+      end
+    end
+
+    def test_dct_method
+      [:ISLOW, :IFAST, :FLOAT].each do |dct|
+        io = StringIO.new
+        JPEG.write(Noise.new(30, 20), io, :dct_method => dct)
+        assert_equal 20, decode(io.string).size
+      end
+
+      assert_raises RuntimeError do
+        JPEG.write(@image, @io_out, :dct_method => :FOO)
+      end
+    end
+
+    def test_smoothing
+      smooth = StringIO.new
+      JPEG.write(Noise.new(100, 100), smooth, :smoothing => 100)
+      assert smooth.size < JPEG.write(Noise.new(100, 100), StringIO.new)
+
+      assert_raises RuntimeError do
+        JPEG.write(@image, @io_out, :smoothing => 101)
+      end
+    end
+
+    def test_profiles
+      io = StringIO.new
+      JPEG.write(Noise.new(50, 40), io, :profile => :web)
+      assert_equal [0xC2, 0x22], frame(io.string)
+
+      io = StringIO.new
+      JPEG.write(Noise.new(50, 40), io, :profile => :archival)
+      assert_equal [0xC0, 0x11], frame(io.string)
+
+      io = StringIO.new
+      JPEG.write(Noise.new(50, 40), io, :profile => :fast)
+      assert_equal [0xC0, 0x22], frame(io.string)
+    end
+
+    def test_options_override_profile
+      JPEG.write(Noise.new(50, 40), @io_out, :profile => :web,
+                 :progressive => false, :subsampling => '4:4:4')
+      assert_equal [0xC0, 0x11], frame(@io_out.string)
+    end
+
+    def test_invalid_profile
+      assert_raises RuntimeError do
+        JPEG.write(@image, @io_out, :profile => :foo)
+      end
+    end
+
     def test_quality_filesize
       file_sizes = {}
       [-10, 0, 1, 50, 100, 130].each do |q|
@@ -117,5 +255,23 @@ module Axon
       image_with_icc = JPEG::Reader.new(io_out)
       assert_equal random_data, image_with_icc.icc_profile
     end
+
+    private
+
+    def decode(data)
+      r = JPEG::Reader.new(data)
+      (1..r.height).map { r.gets }
+    end
+
+    # Returns the frame marker and the luma sampling factors of +data+.
+    def frame(data)
+      bytes = data.unpack('C*')
+      pos = 2
+      loop do
+        marker = bytes[pos + 1]
+        return [marker, bytes[pos + 11]] if (0xC0..0xC2).include?(marker)
+        pos += 2 + (bytes[pos + 2] << 8) + bytes[pos + 3]
+      end
+    end
   end
 end
@@ -0,0 +1,51 @@
+require 'helper'
+require 'tempfile'
+
+module Axon
+  class TestMappedFile < AxonTestCase
+    def setup
+      super
+      skip unless defined?(MappedFile)
+      @tempfile = Tempfile.new('axon')
+      @tempfile.binmode
+      @tempfile.write('0123456789')
+      @tempfile.close
+      @file = MappedFile.new(@tempfile.path)
+    end
+
+    def teardown
+      @tempfile.close! if @tempfile
+    end
+
+    def test_read
+      assert_equal '0123', @file.read(4)
+      assert_equal '456789', @file.read(100)
+      assert_nil @file.read(1)
+      assert_equal '', @file.read
+    end
+
+    def test_read_all
+      assert_equal '0123456789', @file.read
+    end
+
+    def test_empty_file
+      File.open(@tempfile.path, 'wb') {}
+      f = MappedFile.new(@tempfile.path)
+      assert_nil f.read(1)
+      assert_raises(RuntimeError) { PNG::Reader.new(MappedFile.new(@tempfile.path)) }
+    end
+
+    def test_reopen
+      assert_raises(RuntimeError) { @file.send(:initialize, @tempfile.path) }
+    end
+
+    def test_truncated_png
+      io = StringIO.new
+      PNG.write(Noise.new(30, 20), io)
+      File.open(@tempfile.path, 'wb') { |f| f.write(io.string[0, 100]) }
+
+      r = PNG::Reader.new(MappedFile.new(@tempfile.path))
+      assert_raises(RuntimeError) { r.height.times { r.gets } }
+    end
+  end
+end
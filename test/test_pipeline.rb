@@ -0,0 +1,146 @@
+require 'helper'
+
+module Axon
+  class TestPipeline < AxonTestCase
+    # Hides the stage it wraps from the native pipeline so that writers have
+    # to fall back to calling #gets.
+    class Opaque
+      def initialize(source); @source = source; end
+      def width; @source.width; end
+      def height; @source.height; end
+      def components; @source.components; end
+      def lineno; @source.lineno; end
+      def gets; @source.gets; end
+    end
+
+    # Like Opaque, but reads into the buffer it is given and remembers it.
+    class BufferedOpaque < Opaque
+      attr_reader :buffers
+      def gets(buffer=nil)
+        (@buffers ||= []) << buffer
+        @source.gets(buffer)
+      end
+    end
+
+    # Raises once more than +limit+ bytes have been read from it.
+    class FailingIO
+      def initialize(data, limit); @io = StringIO.new(data); @limit = limit; end
+      def read(*args)
+        raise IOError, "read failed" if @io.pos > @limit
+        @io.read(*args)
+      end
+    end
+
+    def setup
+      super
+      io = StringIO.new
+      PNG.write(Noise.new(37, 29), io)
+      @png_data = io.string
+    end
+
+    def assert_same_output(mod)
+      native = StringIO.new
+      mod.write(yield, native)
+
+      ruby = StringIO.new
+      mod.write(Opaque.new(yield), ruby)
+
+      assert_equal ruby.string, native.string
+    end
+
+    def test_crop_and_scale
+      [JPEG, PNG].each do |mod|
+        assert_same_output(mod) do
+          image = Axon.png(@png_data)
+          image.crop(30, 20, 4, 5)
+          image.scale_bilinear(47, 13)
+        end
+      end
+    end
+
+    def test_fit_and_nearest
+      [JPEG, PNG].each do |mod|
+        assert_same_output(mod) do
+          image = Axon.png(@png_data)
+          image.fit(100, 100)
+          image.scale_nearest(20, 90)
+        end
+      end
+    end
+
+    def test_area
+      [JPEG, PNG].each do |mod|
+        assert_same_output(mod) do
+          image = Axon.png(@png_data)
+          image.scale_area(11, 4)
+        end
+      end
+    end
+
+    def test_area_is_native
+      scaler = AreaScaler.new(Axon.png(@png_data), 11, 4)
+      calls = 0
+      scaler.define_singleton_method(:gets) { |*args| calls += 1; super(*args) }
+
+      PNG.write(scaler, @io_out)
+      assert_equal 0, calls
+      assert_equal 4, scaler.lineno
+    end
+
+    def test_alpha_stripper
+      bg = [250, 128, 0].pack('C*')
+      [nil, bg].each do |background|
+        assert_same_output(JPEG) do
+          image = Solid.new(33, 12, [10, 200, 30, 77].pack('C*'))
+          AlphaStripper.new(image, :background => background)
+        end
+      end
+    end
+
+    def test_solid
+      assert_same_output(PNG) { Solid.new(10, 20, "\x01\x02\x03\x04") }
+    end
+
+    def test_buffered_ruby_stage
+      [JPEG, PNG].each do |mod|
+        assert_same_output(mod) do
+          BufferedOpaque.new(Axon.png(@png_data).scale_bilinear(20, 15))
+        end
+      end
+
+      stage = BufferedOpaque.new(Axon.png(@png_data))
+      PNG.write(stage, @io_out)
+      assert_equal 29, stage.buffers.size
+      assert_equal 1, stage.buffers.map { |b| b.object_id }.uniq.size
+    end
+
+    def test_stages_report_lineno
+      image = Axon.png(@png_data)
+      image.scale_bilinear(10, 12)
+      PNG.write(image, @io_out)
+      assert_equal 12, image.lineno
+      assert_nil image.gets
+    end
+
+    def test_reader_error_under_native_stages
+      data = PNG.encode(Noise.new(300, 200))
+
+      [JPEG, PNG].each do |mod|
+        reader = PNG::Reader.new(FailingIO.new(data, 1000), :bufsize => 512)
+        image = Image.new(reader).scale_bilinear(100, 70)
+        assert_raises(IOError) { mod.write(image, StringIO.new) }
+        assert image.lineno < 70
+      end
+    end
+
+    def test_partially_read_source
+      [JPEG, PNG].each do |mod|
+        assert_same_output(mod) do
+          reader = PNG::Reader.new(StringIO.new(@png_data))
+          reader.gets
+          NearestNeighborScaler.new(reader, 20, 10)
+        end
+      end
+    end
+  end
+end
@@ -1,5 +1,6 @@
 require 'helper'
 require 'reader_tests'
+require 'zlib'
 
 module Axon
   module PNG
@@ -11,9 +12,71 @@ module Axon
         io = StringIO.new
         PNG.write(@image, io)
         @data = io.string
+
+        io = StringIO.new
+        PNG.write(Noise.new(300, 200), io)
+        @big_data = io.string
         @readerclass = Reader
         @reader = Reader.new(StringIO.new(@data))
       end
+
+      def test_bufsize
+        sizes = []
+        io = CustomIO.new(Proc.new { |io, len| sizes << len; io.read(len) }, @big_data)
+        r = Reader.new(io, :bufsize => 4096)
+        r.height.times { r.gets }
+
+        assert sizes.all? { |len| len == 4096 }
+        assert_equal (@big_data.size / 4096.0).ceil, sizes.size
+      end
+
+      def test_short_reads
+        io = CustomIO.new(Proc.new { |io, len| io.read(3) }, @data)
+        r = Reader.new(io)
+        r.height.times { r.gets }
+      end
+
+      def test_invalid_bufsize
+        assert_raises(RuntimeError) do
+          Reader.new(StringIO.new(@data), :bufsize => 0)
+        end
+      end
+
+      def test_push_interlaced
+        pixels = (0...11).map { |y| (0...9).map { |x| [x * 20, y * 20, x * y] } }
+        r = Reader.new(nil)
+        rows = []
+        data = interlaced_png(pixels)
+        (0...data.size).step(10) do |i|
+          r << data[i, 10]
+          r.rows_available.times { rows << r.gets.unpack('C*') }
+        end
+
+        assert_equal pixels.map { |row| row.flatten }, rows
+      end
+
+      private
+
+      ADAM7 = [[0, 0, 8, 8], [4, 0, 8, 8], [0, 4, 4, 8], [2, 0, 4, 4],
+               [0, 2, 2, 4], [1, 0, 2, 2], [0, 1, 1, 2]]
+
+      # An Adam7 interlaced RGB PNG of +pixels+, rows of [r, g, b] arrays.
+      def interlaced_png(pixels)
+        raw = ''
+        ADAM7.each do |x0, y0, dx, dy|
+          y0.step(pixels.size - 1, dy) do |y|
+            row = x0.step(pixels[0].size - 1, dx).map { |x| pixels[y][x] }
+            raw << ([0] + row.flatten).pack('C*') unless row.empty?
+          end
+        end
+
+        header = [pixels[0].size, pixels.size, 8, 2, 0, 0, 1].pack('NNC5')
+        [['IHDR', header], ['IDAT', Zlib::Deflate.deflate(raw)], ['IEND', '']].
+          inject([137, 80, 78, 71, 13, 10, 26, 10].pack('C*')) do |png, (type, body)|
+          png + [body.size].pack('N') + type + body +
+            [Zlib.crc32(type + body)].pack('N')
+        end
+      end
     end
   end
 end
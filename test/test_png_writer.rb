@@ -10,6 +10,112 @@ module Axon
         super
         @mod = PNG
       end
+
+      def test_invalid_bufsize
+        assert_raises RuntimeError do
+          PNG.write(@image, @io_out, :bufsize => 0)
+        end
+
+        assert_raises RuntimeError do
+          PNG.write(@image, @io_out, :bufsize => -5)
+        end
+      end
+
+      def test_symbol_bufsize
+        skip_symbol_fixnums
+        assert_raises TypeError do
+          PNG.write(@image, @io_out, :bufsize => :foo)
+        end
+      end
+
+      def test_compression_filesize
+        sizes = [0, 1, 9].map do |level|
+          image = ArrayWrapper.new(["\x01\x02\x03" * 200] * 100, 1)
+          PNG.write(image, StringIO.new, :compression => level)
+        end
+
+        assert sizes[0] > sizes[1]
+        assert sizes[1] >= sizes[2]
+      end
+
+      def test_invalid_compression
+        assert_raises(RuntimeError) do
+          PNG.write(@image, @io_out, :compression => 10)
+        end
+      end
+
+      def test_filters_and_strategies
+        expected = (1..40).map { |i| [i, i * 3, 255 - i].pack('C*') * 30 }
+
+        [:none, :sub, :up, :avg, :paeth, :adaptive].each do |filter|
+          [:default, :filtered, :huffman_only, :rle, :fixed].each do |strategy|
+            io = StringIO.new
+            PNG.write(ArrayWrapper.new(expected, 1), io, :filter => filter,
+                      :strategy => strategy)
+
+            r = Reader.new(io.string)
+            assert_equal expected, (1..r.height).map { r.gets }
+          end
+        end
+      end
+
+      def test_presets
+        data = (1..40).map { |i| [i, i * 3, 255 - i].pack('C*') * 30 }
+        sizes = [{:preset => :fast}, {:preset => :small},
+                 {:preset => :fast, :compression => 0}].map do |o|
+          PNG.write(ArrayWrapper.new(data, 1), StringIO.new, o)
+        end
+
+        assert sizes[1] <= sizes[0]
+        assert sizes[2] > sizes[0]
+      end
+
+      def test_invalid_filter_options
+        [{:filter => :foo}, {:strategy => :foo}, {:preset => :foo}].each do |o|
+          assert_raises(RuntimeError) { PNG.write(@image, @io_out, o) }
+        end
+      end
+
+      def test_threads
+        io = StringIO.new
+        PNG.write(Noise.new(300, 600), io)
+        data = io.string
+        r = Reader.new(data)
+        expected = (1..r.height).map { r.gets }
+
+        [{:threads => 2}, {:threads => 3, :filter => :paeth},
+         {:threads => 4, :preset => :fast}, {:threads => 2, :compression => 0},
+         {:threads => 16, :filter => :avg, :strategy => :rle}].each do |o|
+          io = StringIO.new
+          size = PNG.write(Reader.new(data), io, o)
+          assert_equal io.size, size
+
+          r = Reader.new(io.string)
+          assert_equal expected, (1..r.height).map { r.gets }
+          assert_nil r.gets
+        end
+      end
+
+      def test_threads_small_image
+        io = StringIO.new
+        PNG.write(@image, io, :threads => 4)
+        r = Reader.new(io.string)
+        assert_equal Solid.new(10, 16, "\x0A\x14\x69").gets, r.gets
+      end
+
+      def test_invalid_threads
+        assert_raises(RuntimeError) { PNG.write(@image, @io_out, :threads => 0) }
+      end
+
+      def test_bufsize_coalesces_writes
+        writes = []
+        io = CustomIO.new(Proc.new { |io, str| writes << str.size; str.size })
+        size = PNG.write(Noise.new(100, 80), io, :bufsize => 1000)
+
+        assert writes.size > 1
+        assert_equal size, writes.inject(0) { |a, b| a + b }
+        writes[0..-2].each { |w| assert w >= 1000 }
+      end
     end
   end
 end
@@ -0,0 +1,142 @@
+require 'helper'
+require 'tempfile'
+require 'zlib'
+
+module Axon
+  class TestProbe < AxonTestCase
+    def setup
+      super
+      io = StringIO.new
+      JPEG.write(Solid.new(33, 21), io)
+      @jpeg = io.string
+
+      io = StringIO.new
+      PNG.write(Solid.new(13, 7, "\x80\x10"), io)
+      @png = io.string
+    end
+
+    def test_jpeg
+      info = Axon.probe(@jpeg)
+
+      assert_equal :jpeg, info.format
+      assert_equal 33, info.width
+      assert_equal 21, info.height
+      assert_equal 3, info.components
+      assert_equal :YCbCr, info.color_model
+      assert_equal false, info.progressive
+      assert_equal 1, info.orientation
+    end
+
+    def test_jpeg_matches_reader
+      io = StringIO.new
+      JPEG.write(Solid.new(40, 30, "\x80"), io, :progressive => true)
+      info = Axon.probe(io.string)
+      reader = JPEG::Reader.new(io.string)
+
+      assert_equal [reader.width, reader.height], [info.width, info.height]
+      assert_equal reader.components, info.components
+      assert_equal reader.in_color_model, info.color_model
+      assert info.progressive
+    end
+
+    def test_jpeg_orientation
+      exif = ["MM", 42, 8, 1, 0x0112, 3, 1, 6, 0, 0].pack('a2nNnnnNnnN')
+      io = StringIO.new
+      JPEG.write(Solid.new(10, 16), io, :exif => exif)
+      assert_equal 6, Axon.probe(io.string).orientation
+
+      exif = ["II", 42, 8, 1, 0x0112, 3, 1, 8, 0, 0].pack('a2vVvvvVvvV')
+      io = StringIO.new
+      JPEG.write(Solid.new(10, 16), io, :exif => exif)
+      assert_equal 8, Axon.probe(io.string).orientation
+    end
+
+    def test_png
+      info = Axon.probe(@png)
+
+      assert_equal :png, info.format
+      assert_equal [13, 7], [info.width, info.height]
+      assert_equal 2, info.components
+      assert_equal :GRAYSCALE_ALPHA, info.color_model
+      assert_equal false, info.interlaced
+    end
+
+    def test_png_palette_with_transparency
+      data = png_chunks(['IHDR', [2, 1, 8, 3, 0, 0, 1].pack('NNC5')],
+                        ['PLTE', [255, 0, 0, 0, 0, 255].pack('C*')],
+                        ['tRNS', [128].pack('C')],
+                        ['IDAT', Zlib::Deflate.deflate("\x00\x00\x01")],
+                        ['IEND', ''])
+      info = Axon.probe(data)
+
+      assert_equal 4, info.components
+      assert_equal :RGB_ALPHA, info.color_model
+      assert info.interlaced
+    end
+
+    def test_path_io_and_mapped_file
+      with_tempfile(@jpeg) do |path|
+        assert_equal 33, Axon.probe(path).width
+        File.open(path, 'rb') { |f| assert_equal 33, Axon.probe(f).width }
+        assert_equal 33, Axon.probe(MappedFile.new(path)).width
+      end
+    end
+
+    def test_truncated
+      assert_raises(RuntimeError) { Axon.probe(@jpeg[0, 30]) }
+      assert_raises(RuntimeError) { Axon.probe(@png[0, 20]) }
+      assert_raises(RuntimeError) { Axon.probe(StringIO.new("not an image")) }
+    end
+
+    def test_open
+      assert_image_dimensions(Axon.open(@jpeg), 33, 21)
+      assert_image_dimensions(Axon.open(StringIO.new(@png)), 13, 7)
+
+      with_tempfile(@png) do |path|
+        Axon.open(path) { |image| assert_image_dimensions(image, 13, 7) }
+      end
+    end
+
+    def test_open_unseekable_io
+      r, w = IO.pipe
+      w.write(@jpeg)
+      w.close
+      assert_image_dimensions(Axon.open(r), 33, 21)
+    ensure
+      r.close
+    end
+
+    def test_open_passes_arguments
+      exif = ["MM", 42, 8, 0, 0].pack('a2nNnN')
+      io = StringIO.new
+      JPEG.write(@image, io, :exif => exif)
+
+      assert_nil Axon.open(io.string, [:APP2]).instance_variable_get(:@source).exif
+      assert_equal exif, Axon.open(io.string).instance_variable_get(:@source).exif
+    end
+
+    def test_open_not_an_image
+      assert_raises(RuntimeError) { Axon.open(StringIO.new("not an image")) }
+    end
+
+    private
+
+    def png_chunks(*chunks)
+      signature = [137, 80, 78, 71, 13, 10, 26, 10].pack('C*')
+      chunks.inject(signature) do |data, (type, body)|
+        data + [body.size].pack('N') + type + body +
+          [Zlib.crc32(type + body)].pack('N')
+      end
+    end
+
+    def with_tempfile(data)
+      f = Tempfile.new('axon')
+      f.binmode
+      f.write(data)
+      f.close
+      yield f.path
+    ensure
+      f.close!
+    end
+  end
+end
@@ -0,0 +1,79 @@
+require 'helper'
+
+module Axon
+  class TestTee < AxonTestCase
+    def setup
+      super
+      @source = Noise.new(20, 30)
+    end
+
+    def test_branches_get_the_same_rows
+      tee = Tee.new(@source)
+      a = tee.branch
+      b = tee.branch
+
+      30.times do
+        assert_equal a.gets, b.gets
+      end
+      assert_nil a.gets
+      assert_nil b.gets
+    end
+
+    def test_branch_dimensions
+      tee = Tee.new(@source)
+      assert_image_dimensions(tee.branch, 20, 30)
+    end
+
+    def test_source_height_read_once
+      calls = 0
+      source = CustomHeightImage.new(Proc.new { calls += 1; 200 })
+      branch = Tee.new(source).branch
+
+      200.times { branch.gets }
+      assert_nil branch.gets
+      assert_equal 1, calls
+    end
+
+    def test_gets_into_buffer
+      tee = Tee.new(@source)
+      branch = tee.branch
+      buf = ''
+      assert_same buf, branch.gets(buf)
+      assert_equal 60, buf.size
+    end
+
+    def test_window
+      tee = Tee.new(@source, 4)
+      a = tee.branch
+      b = tee.branch
+
+      t = Thread.new { rows = []; 30.times { rows << a.gets }; rows }
+      sleep 0.05
+      assert t.alive?, 'a branch should wait for the slowest branch'
+
+      rows = []
+      30.times { rows << b.gets }
+      assert_equal rows, t.value
+    end
+
+    def test_closed_branch_does_not_block
+      tee = Tee.new(@source, 2)
+      a = tee.branch
+      b = tee.branch
+      b.close
+
+      30.times { assert a.gets }
+      assert_nil b.gets
+    end
+
+    def test_branch_after_read
+      tee = Tee.new(@source)
+      tee.branch.gets
+      assert_raises(RuntimeError) { tee.branch }
+    end
+
+    def test_invalid_window
+      assert_raises(ArgumentError) { Tee.new(@source, 0) }
+    end
+  end
+end
@@ -1,3 +1,5 @@
+require 'tempfile'
+
 module Axon
   module WriterTests
     def test_writes_something
@@ -178,6 +180,105 @@ module Axon
       end
     end
 
+    def test_io_raises_exception_later
+      writes = 0
+      io = CustomIO.new(Proc.new{ |io, str| (writes += 1) > 2 ? raise(CustomError) : io.write(str) })
+      assert_raises CustomError do
+        @mod.write(Noise.new(200, 100), io)
+      end
+    end
+
+    def test_concurrent_writes
+      expected = StringIO.new
+      @mod.write(Solid.new(100, 200), expected)
+
+      threads = (1..4).map do
+        Thread.new do
+          io = StringIO.new
+          @mod.write(Solid.new(100, 200), io)
+          io.string
+        end
+      end
+
+      threads.each { |t| assert_equal expected.string, t.value }
+    end
+
+    def test_encode
+      @mod.write(Solid.new(100, 200), @io_out)
+      data = @mod.encode(Solid.new(100, 200))
+
+      assert_equal @io_out.string, data
+      assert_equal Encoding::BINARY, data.encoding if data.respond_to?(:encoding)
+    end
+
+    def test_encode_size_hint
+      noise = StringIO.new
+      PNG.write(Noise.new(120, 80), noise)
+
+      expected = @mod.encode(PNG::Reader.new(noise.string))
+      [1, 100, 1_000_000].each do |hint|
+        data = @mod.encode(PNG::Reader.new(noise.string), :size_hint => hint)
+        assert_equal expected, data
+      end
+    end
+
+    def test_encode_threads
+      noise = StringIO.new
+      PNG.write(Noise.new(300, 400), noise)
+
+      @mod.write(PNG::Reader.new(noise.string), @io_out, :threads => 3)
+      data = @mod.encode(PNG::Reader.new(noise.string), :threads => 3,
+                         :size_hint => 10)
+      assert_equal @io_out.string, data
+    end
+
+    def test_encode_invalid_size_hint
+      assert_raises(RuntimeError) { @mod.encode(@image, :size_hint => -1) }
+    end
+
+    def test_write_to_file
+      noise = StringIO.new
+      PNG.write(Noise.new(300, 200), noise)
+
+      [{}, { :size_hint => 1_000_000 }, { :threads => 3 }].each do |options|
+        expected = @mod.encode(PNG::Reader.new(noise.string), options)
+
+        with_output_file('wb') do |f, path|
+          f.write("head")
+          ret = @mod.write(PNG::Reader.new(noise.string), f, options)
+          f.write("tail")
+          f.close
+
+          assert_equal expected.size, ret
+          data = File.open(path, 'rb') { |r| r.read }
+          assert_equal "head" + expected + "tail", data
+        end
+      end
+    end
+
+    def test_write_to_file_in_text_mode
+      @mod.write(Solid.new(30, 20), @io_out)
+      with_output_file('w') do |f, path|
+        @mod.write(Solid.new(30, 20), f)
+        f.close
+        assert_equal @io_out.string, File.open(path, 'rb') { |r| r.read }
+      end
+    end
+
+    def test_write_to_closed_file
+      with_output_file('wb') do |f, path|
+        f.close
+        assert_raises(IOError) { @mod.write(@image, f) }
+      end
+    end
+
+    def with_output_file(mode)
+      path = Tempfile.new('axon').path
+      File.open(path, mode) { |f| yield f, path }
+    ensure
+      File.delete(path) if path && File.exist?(path)
+    end
+
     def test_io_returns_invalid_type
       skip "JRuby doesn't mind odd io returns" if(RUBY_PLATFORM =~ /java/)
       [nil, "bar"].each do |r|